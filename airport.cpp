@@ -106,13 +106,36 @@ In this case, the throughput is increased to 10/10 minutes(eg. 1 person per minu
 #include <chrono>
 #include <ctime>
 #include <string>
-#include <queue>
 #include <atomic>
 #include <mutex>
-#include <condition_variable>
 #include <stdexcept>
 #include <functional>
 #include <memory>
+#include <deque>
+#include <iomanip>
+#include <limits>
+#include <random>
+#include <string_view>
+#include <unordered_map>
+#include <cstdint>
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+#include <filesystem>
+#include <fstream>
+#include <charconv>
+#include <span>
+
+#include "threadpool.hpp"
+#include "task_graph.hpp"
+#include "coro.hpp"
+#include "timer.hpp"
+#include "pipeline.hpp"
+#include "event_simulation.hpp"
+#include "distributions.hpp"
+#include "monte_carlo.hpp"
+#include "async_logger.hpp"
+#include "arrival_trace.hpp"
 
 
 template <typename S>
@@ -172,274 +195,1008 @@ public:
 	// }
 };
 
-bool DEBUG = true;
-auto PROGRAM_START_TIME = std::chrono::high_resolution_clock::now();
-std::mutex cout_lock;
-long scaleFactor = 10;
-std::vector<Person> passengers;
-std::queue<Person> atBoardingPassCheck;
-std::queue<Person> atSecurityCheck;
-std::queue<Person> enteredAirport;
-std::mutex mtx_atBoardingPassCheck;
-std::mutex mtx_atSecurityCheck;
-std::mutex mtx_enteredAirport;
-std::condition_variable cv_atBoardingPassCheck;
-std::condition_variable cv_atSecurityCheck;
-std::condition_variable cv_enteredAirport;
-bool isBoardingPassCheckDone = false;
-bool isSecurityCheckDone = false;
-bool isAllChecksDone = false;
-
-// source: https://www.youtube.com/watch?v=ZKIhHLM9MfQ
-class thread_pool
+// The passengers in columns instead of Person objects, a passenger is just an index into them.
+// Names are interned: "Person 17" is the shared prefix "Person " and the number 17, the string
+// is only put together when somebody prints it. Every stage has a column of start and finish
+// times (ns since the run started), only the worker serving a passenger writes its row.
+class PassengerStore
 {
 public:
-	thread_pool(const thread_pool &) = delete;
-	thread_pool(thread_pool &&) = delete;
-	thread_pool &operator=(const thread_pool &) = delete;
-	thread_pool &operator=(thread_pool &&) = delete;
+	using Id = std::uint32_t;
+
+	explicit PassengerStore(std::size_t numberOfStages) : starts_(numberOfStages), finishes_(numberOfStages) {}
 
-	explicit thread_pool(std::size_t thread_count = (std::thread::hardware_concurrency() - 1))
+	Id add(std::string_view name)
 	{
-		if (!thread_count)
-			throw std::invalid_argument("Thread count must be non-zero.");
-		std::size_t max_threads = std::thread::hardware_concurrency() - 1; // -1 because we need one thread for the main thread
-		if (!(thread_count > 0) || !(thread_count <= max_threads))
-			std::out_of_range(std::string("Thread count must be between 1 and %s.", max_threads));
+		Id id = Id(size());
+		names_.push_back(intern(name));
+		numbers_.push_back(0);
+		grow();
+		return id;
+	}
+	// `count` passengers called prefix1, prefix2, ..., returns the first one
+	Id addNumbered(std::string_view prefix, std::size_t count)
+	{
+		Id first = Id(size());
+		std::uint32_t name = intern(prefix);
+		names_.resize(size() + count, name);
+		numbers_.reserve(numbers_.size() + count);
+		for (std::size_t i = 1; i <= count; i++) numbers_.push_back(std::uint32_t(i));
+		grow();
+		return first;
+	}
 
-		for (std::size_t i = 1; i <= thread_count; ++i)
-		{
-			worker_threads_.push_back(std::thread([this, thread_id = i]()
-												  {
-					while (true){
-						work_item_ptr_t work{nullptr};
-						{
-							// Thread safe way to take a work item off the queue
-							std::unique_lock<std::mutex> guard(mtx_work_queue_);
-							cv_work_queue_.wait(guard, [this](){ return !work_queue_.empty(); }); // wait until there is some work to do
-
-							work = std::move(work_queue_.front());
-							work_queue_.pop();
-						}
-
-						if(!work) break; // when the work is a null pointer stop the thread
-
-						// Run the work item
-						(*work)();
-					} }));
-		}
-	};
-	~thread_pool()
+	std::string name(Id id) const
 	{
-		if (worker_threads_.size() == 0)
-			return;
-		{
-			// stop the threads by pushing null pointer work items
-			std::unique_lock<std::mutex> guard(mtx_work_queue_);
-			for (std::size_t i = 0; i < worker_threads_.size(); ++i)
-				work_queue_.push(work_item_ptr_t(nullptr));
-			cv_work_queue_.notify_all();
-		}
+		const std::string& name = prefix(id);
+		return numbers_[id] ? name + std::to_string(numbers_[id]) : name;
+	}
+	// The two halves of name(), for callers that don't want to build the string
+	const std::string& prefix(Id id) const { return interned_[names_[id]]; }
+	std::uint32_t number(Id id) const { return numbers_[id]; }
+	std::size_t size() const { return names_.size(); }
+
+	void stamp(Id id, std::size_t stage, std::int64_t startNs, std::int64_t finishNs)
+	{
+		starts_[stage][id] = startNs;
+		finishes_[stage][id] = finishNs;
+	}
+	std::int64_t startNs(Id id, std::size_t stage) const { return starts_[stage][id]; }
+	std::int64_t finishNs(Id id, std::size_t stage) const { return finishes_[stage][id]; }
+
+private:
+	std::uint32_t intern(std::string_view name)
+	{
+		auto [it, added] = internedIds_.try_emplace(std::string(name), std::uint32_t(interned_.size()));
+		if (added) interned_.push_back(it->first);
+		return it->second;
+	}
+	void grow()
+	{
+		for (auto& column : starts_) column.resize(size());
+		for (auto& column : finishes_) column.resize(size());
+	}
+
+	std::vector<std::string> interned_;
+	std::unordered_map<std::string, std::uint32_t> internedIds_;
+	std::vector<std::uint32_t> names_;   // index into interned_
+	std::vector<std::uint32_t> numbers_; // appended to the name, 0 for none
+	std::vector<std::vector<std::int64_t>> starts_;
+	std::vector<std::vector<std::int64_t>> finishes_;
+};
+
+bool DEBUG = true;
+// Machines log without waiting for each other or the terminal, see serve()
+async_logger logger(std::cout, logger_options{.prefix = false});
+long scaleFactor = 10;
 
-		for (auto &t : worker_threads_)
-			if (t.joinable())
-				t.join();
-		worker_threads_ = std::vector<std::thread>{};
+// One machine of stage number `stage` serving one passenger. The machine is busy until the
+// timer calls `done`, no thread waits for it meanwhile. `startTime` is when the run started,
+// times count from there.
+void serve(timer_queue& timers, PassengerStore& passengers, std::size_t stage, const char* stageName, std::chrono::duration<double, std::milli> timeToProcess1Person,
+	PassengerStore::Id passenger, std::chrono::high_resolution_clock::time_point startTime, thread_pool::work_item_t done)
+{
+	auto since = [startTime](){
+		return std::int64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now() - startTime).count());
+	};
+	auto log = [&passengers, stageName, passenger](const char* what, std::int64_t at){
+		if (!DEBUG) return;
+		long long scaledTime = at / 1000000 / scaleFactor;
+		// Prefix and number go to the logger separately, its writer thread puts the name together
+		std::uint32_t number = passengers.number(passenger);
+		if (number) logger.log("At {}mins \t{}{}{}{}", scaledTime, stageName, what, passengers.prefix(passenger), number);
+		else logger.log("At {}mins \t{}{}{}", scaledTime, stageName, what, passengers.prefix(passenger));
 	};
+	std::int64_t start = since();
+	log(" is processing ", start);
+	// Simulate doing work
+	timers.call_after(timeToProcess1Person * scaleFactor, [&passengers, stage, passenger, since, log, start, done = std::move(done)]() mutable {
+		std::int64_t finish = since();
+		log(" is done processing ", finish);
+		passengers.stamp(passenger, stage, start, finish);
+		done();
+	});
+}
 
-	using work_item_t = std::function<void(void)>;
-	void do_work(work_item_t work_item)
+// Where the time went, per stage and end to end, in (scaled) minutes. Queueing at the first
+// stage is the arrival backlog, as far as it fits into the channel (the rest waits in push()).
+// In a balanced pipeline nobody queues at the later stages, their time is only the service.
+void printTrace(const trace_report& trace)
+{
+	using namespace std;
+	auto mins = [](double ms){ return ms / double(scaleFactor); };
+	auto row = [&](const string& name, const latency_summary& summary){
+		cout << left << setw(34) << name << right << setw(10) << mins(summary.mean_ms) << setw(10) << mins(summary.p50_ms)
+			 << setw(10) << mins(summary.p99_ms) << setw(10) << mins(summary.max_ms) << endl;
+	};
+	cout << fixed << setprecision(1);
+	cout << left << setw(34) << "(mins)" << right << setw(10) << "mean" << setw(10) << "p50" << setw(10) << "p99" << setw(10) << "max" << endl;
+	for (const stage_latency& stage : trace.stages)
 	{
-		auto wi = std::make_unique<work_item_t>(std::move(work_item));
-		{
-			std::unique_lock<std::mutex> guard(mtx_work_queue_);
-			work_queue_.push(std::move(wi));
-		}
-		cv_work_queue_.notify_one();
+		row(stage.name + " queueing", stage.queueing);
+		row(stage.name + " service", stage.service);
+	}
+	row("End to end", trace.end_to_end);
+	cout << "Steady state throughput: " << setprecision(3) << trace.steady_throughput * double(scaleFactor) / 1000.0 << "/min over "
+		 << trace.items << " passengers" << defaultfloat << setprecision(6) << endl;
+}
+
+// What the stages cost without the sleeping: a million passengers through both stages, once
+// as Person objects (a string allocated per passenger, moved at every hop) and once as store ids
+void timeHandOff(std::size_t numberOfPassengers)
+{
+	using namespace std;
+	auto run = [](auto&& feed, auto source){
+		auto checks = source
+			.then("Boarding Pass Check", 1, [](auto passenger){ return passenger; })
+			.then("Security Check", 1, [](auto){});
+		auto start_time = chrono::high_resolution_clock::now();
+		feed(checks);
+		checks.close();
+		checks.wait();
+		chrono::duration<double, milli> duration = chrono::high_resolution_clock::now() - start_time;
+		return duration.count();
 	};
 
-private:
-	using work_item_ptr_t = std::unique_ptr<work_item_t>;
-	using work_queue_t = std::queue<work_item_ptr_t>;
+	double objects = run([numberOfPassengers](auto& checks){
+		for (size_t i = 1; i <= numberOfPassengers; i++) checks.push(Person(std::string("Person ") + std::to_string(i)));
+	}, pipeline<Person>(1024));
+
+	PassengerStore passengers(2);
+	double ids = run([&passengers, numberOfPassengers](auto& checks){
+		PassengerStore::Id first = passengers.addNumbered("Person ", numberOfPassengers);
+		for (PassengerStore::Id id = first; id < first + numberOfPassengers; id++) checks.push(id);
+	}, pipeline<PassengerStore::Id>(1024));
+
+	cout << "Hand-off of " << numberOfPassengers << " passengers through 2 stages: Person objects " << objects << "ms, store ids " << ids << "ms" << endl << endl;
+}
+
+// The same pipeline expressed as a dependency graph instead of stages and channels.
+// Every passenger has a boarding node and a security node. A machine serves one passenger at a
+// time, so passenger i's step also waits for the passenger who used that machine before them.
+//   boarding[i]  after boarding[i - numberOfBoardingPassMachines]
+//   security[i]  after boarding[i] and security[i - numberOfSecurityMachines]
+void timeWithTaskGraph(std::size_t numberOfPassengers, std::size_t numberOfBoardingPassMachines, std::size_t numberOfSecurityMachines)
+{
+	using namespace std;
+	thread_pool pool(numberOfBoardingPassMachines + numberOfSecurityMachines);
+	task_graph graph(pool);
+	vector<task_graph::node_id> boarding, security;
+	for (size_t i = 0; i < numberOfPassengers; i++)
+	{
+		vector<task_graph::node_id> boardingAfter, securityAfter;
+		if (i >= numberOfBoardingPassMachines) boardingAfter.push_back(boarding[i - numberOfBoardingPassMachines]);
+		boarding.push_back(graph.add([](){ this_thread::sleep_for(chrono::milliseconds(1) * scaleFactor); }, boardingAfter));
+
+		securityAfter.push_back(boarding[i]);
+		if (i >= numberOfSecurityMachines) securityAfter.push_back(security[i - numberOfSecurityMachines]);
+		security.push_back(graph.add([](){ this_thread::sleep_for(chrono::milliseconds(10) * scaleFactor); }, securityAfter));
+	}
+
+	auto start_time = chrono::high_resolution_clock::now();
+	graph.run();
+	auto duration = chrono::duration_cast<chrono::milliseconds>(chrono::high_resolution_clock::now() - start_time);
+	cout << "Task graph \tPassengers: " << numberOfPassengers << " \tBoardingPassMachines: " << numberOfBoardingPassMachines
+		 << " \tSecurityCheckMachines: " << numberOfSecurityMachines << " \tElapsed: " << duration.count() / scaleFactor << "mins." << endl;
+}
+
+// Same airport again with coroutines. Instead of a pipeline stage keeping count of its busy
+// machines, every machine is a coroutine that gives its thread back while it "works", so
+// any number of machines runs on a couple of threads.
+// Boarding machine m serves passengers m, m + numberOfBoardingPassMachines, ... and security
+// line k serves k, k + numberOfSecurityMachines, ... once they have their boarding pass scanned.
+coro::task<void> boardingPassMachine(timer_queue& timers, std::vector<coro::event>& boarded, std::size_t first, std::size_t step)
+{
+	// Deadlines are counted from the previous one, so timer lateness doesn't add up
+	auto freeAt = timer_queue::clock_type::now();
+	for (std::size_t i = first; i < boarded.size(); i += step)
+	{
+		freeAt += std::chrono::milliseconds(1) * scaleFactor;
+		co_await timers.sleep_until(freeAt);
+		boarded[i].set();
+	}
+}
+
+coro::task<void> securityLine(timer_queue& timers, std::vector<coro::event>& boarded, std::size_t first, std::size_t step)
+{
+	auto freeAt = timer_queue::clock_type::now();
+	for (std::size_t i = first; i < boarded.size(); i += step)
+	{
+		co_await boarded[i];
+		freeAt = std::max(freeAt, timer_queue::clock_type::now()) + std::chrono::milliseconds(10) * scaleFactor;
+		co_await timers.sleep_until(freeAt);
+	}
+}
+
+void timeWithCoroutines(std::size_t numberOfPassengers, std::size_t numberOfBoardingPassMachines, std::size_t numberOfSecurityMachines)
+{
+	using namespace std;
+	thread_pool pool(2);
+	timer_queue timers(pool);
+	vector<coro::event> boarded(numberOfPassengers);
+	vector<coro::task<void>> machines;
+	for (size_t m = 0; m < numberOfBoardingPassMachines; m++) machines.push_back(boardingPassMachine(timers, boarded, m, numberOfBoardingPassMachines));
+	for (size_t k = 0; k < numberOfSecurityMachines; k++) machines.push_back(securityLine(timers, boarded, k, numberOfSecurityMachines));
+
+	auto start_time = chrono::high_resolution_clock::now();
+	coro::sync_wait(coro::when_all(std::move(machines)));
+	auto duration = chrono::duration_cast<chrono::milliseconds>(chrono::high_resolution_clock::now() - start_time);
+	cout << "Coroutines (" << pool.size() << " threads) 	Passengers: " << numberOfPassengers << " 	BoardingPassMachines: " << numberOfBoardingPassMachines
+		 << " 	SecurityCheckMachines: " << numberOfSecurityMachines << " 	Elapsed: " << duration.count() / scaleFactor << "mins." << endl;
+}
+
+// How a stage with several machines gets passengers to them. SharedLine is one FIFO line
+// for all machines (what a thread_pool does), the others give every machine its own line
+// and pick one when a passenger gets to the stage:
+//   RoundRobin         the next line in turn
+//   JoinShortestLine   the line with the fewest people, counting the one at the machine
+//   PowerOfTwoChoices  the shorter of two lines picked at random
+enum class Dispatch { SharedLine, RoundRobin, JoinShortestLine, PowerOfTwoChoices };
 
-	work_queue_t work_queue_;
-	work_queue_t finished_work_queue_;
-	std::mutex mtx_work_queue_;
-	std::condition_variable cv_work_queue_;
+const char* dispatchName(Dispatch dispatch)
+{
+	switch (dispatch)
+	{
+		case Dispatch::RoundRobin: return "round robin";
+		case Dispatch::JoinShortestLine: return "join shortest line";
+		case Dispatch::PowerOfTwoChoices: return "power of two choices";
+		default: return "shared line";
+	}
+}
 
-	using threads_t = std::vector<std::thread>;
-	threads_t worker_threads_;
+// The same model in virtual time: a discrete-event simulation of the stages. By default every
+// stage has one FIFO line in front of its machines, a busy machine is free again at its "done"
+// event. Everybody stands in the first line at minute 0 and services take fixed times, an
+// arrival_process and service_distributions make it stochastic (seeded, so repeatable).
+// Nothing sleeps, so the results are exact, don't depend on the OS scheduler and a million
+// passengers take milliseconds.
+struct SimulatedStage
+{
+	std::string name;
+	service_distribution minutesPerPerson;
+	std::size_t machines;
+	Dispatch dispatch = Dispatch::SharedLine;
 };
 
-class SecurityCheckStage
+struct SimulationResult
 {
-private:
-	std::string name_;
-	std::chrono::milliseconds timeToProcess1Person_; // time in miliseconds
-	thread_pool security_check_pool_;
+	double minutes = 0;            // until the last passenger is through
+	double throughput = 0;         // passengers per minute between the first and the last one getting through
+	double analyticThroughput = 0; // what the slowest stage can do, machines / minutesPerPerson
+	// Latency counts from a passenger's first machine to getting through the last stage,
+	// the line in front of the first stage is the arrival backlog and not part of it
+	double minLatency = 0;
+	double meanLatency = 0;
+	double p99Latency = 0;
+	double maxLatency = 0;
+	// Minutes spent in lines, from arriving to getting through minus the time at the machines
+	double meanWait = 0;
+	double p99Wait = 0;
+	double maxWait = 0;
+	std::size_t events = 0;
 
-public:
-	SecurityCheckStage(
-		std::string name,
-		std::chrono::milliseconds timeToProcess1Person,
-		int numberOfMachines
-		) : 
-			name_(name),
-			timeToProcess1Person_(timeToProcess1Person),
-			security_check_pool_(numberOfMachines) {}
-
-	void process_person(Person person, std::function<void(Person person)> callback) {
-		security_check_pool_.do_work([this, person = person, callback = callback](){
-			if (DEBUG) {
-				auto end_time = std::chrono::high_resolution_clock::now();
-				auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - PROGRAM_START_TIME);
-				long long scaledTime = duration.count() / scaleFactor;
-				std::lock_guard<std::mutex> guard(cout_lock);
-				std::cout << "At " << scaledTime << "mins \t" << name_ << " is processing " << person.getName() << std::endl;
+	// Constant latency, nobody waits between the stages
+	bool balanced() const { return maxLatency - minLatency < 1e-9; }
+};
+
+SimulationResult simulateAirport(std::size_t numberOfPassengers, const std::vector<SimulatedStage>& stages,
+	const arrival_process& arrivals = arrival_process::all_at_once(), std::uint64_t seed = 1)
+{
+	using namespace std;
+	if (stages.empty()) throw invalid_argument("The airport needs at least one stage.");
+	SimulationResult result;
+	result.analyticThroughput = numeric_limits<double>::infinity();
+	for (const SimulatedStage& stage : stages)
+	{
+		if (!stage.machines) throw invalid_argument("Stage " + stage.name + " needs machines.");
+		result.analyticThroughput = min(result.analyticThroughput, double(stage.machines) / stage.minutesPerPerson.mean());
+	}
+
+	// `passenger` shows up at the airport, or `machine` of `stage` is done with them
+	struct Event
+	{
+		bool arrival;
+		size_t stage;
+		size_t machine; // only means something when the machines have their own lines
+		size_t passenger;
+	};
+	// One line for the stage, or one per machine and which machines are busy
+	struct Lines
+	{
+		vector<deque<size_t>> lines;
+		vector<bool> busy;
+		size_t freeMachines = 0;
+		size_t nextLine = 0;
+
+		size_t length(size_t machine) const { return lines[machine].size() + busy[machine]; }
+	};
+	event_simulation<Event> sim;
+	mt19937_64 rng(seed);
+	vector<Lines> stageLines(stages.size());
+	for (size_t i = 0; i < stages.size(); i++)
+	{
+		bool shared = stages[i].dispatch == Dispatch::SharedLine;
+		stageLines[i].lines.resize(shared ? 1 : stages[i].machines);
+		stageLines[i].busy.resize(shared ? 1 : stages[i].machines);
+		stageLines[i].freeMachines = stages[i].machines;
+	}
+	vector<double> arrivedAt(numberOfPassengers), startedAt(numberOfPassengers), servedFor(numberOfPassengers);
+
+	auto startService = [&](size_t stage, size_t machine, size_t passenger){
+		if (stage == 0) startedAt[passenger] = sim.now();
+		double minutes = stages[stage].minutesPerPerson(rng);
+		servedFor[passenger] += minutes;
+		sim.schedule_after(minutes, Event{false, stage, machine, passenger});
+	};
+	auto pickLine = [&](size_t stage){
+		Lines& l = stageLines[stage];
+		size_t machines = l.lines.size();
+		switch (stages[stage].dispatch)
+		{
+			case Dispatch::RoundRobin: return l.nextLine++ % machines;
+			case Dispatch::JoinShortestLine:
+			{
+				size_t best = 0;
+				for (size_t m = 1; m < machines; m++) if (l.length(m) < l.length(best)) best = m;
+				return best;
+			}
+			case Dispatch::PowerOfTwoChoices:
+			{
+				if (machines == 1) return size_t(0);
+				size_t a = uniform_int_distribution<size_t>(0, machines - 1)(rng);
+				size_t b = uniform_int_distribution<size_t>(0, machines - 2)(rng);
+				if (b >= a) ++b;
+				return l.length(b) < l.length(a) ? b : a;
 			}
-			
-			// Simulate doing work
-			std::this_thread::sleep_for(timeToProcess1Person_ * scaleFactor);
-			if (DEBUG) {
-				auto end_time = std::chrono::high_resolution_clock::now();
-				auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - PROGRAM_START_TIME);
-				long long scaledTime = duration.count() / scaleFactor;
-				std::lock_guard<std::mutex> guard(cout_lock);
-				std::cout << "At " << scaledTime << "mins \t" << name_ << " is done processing " << person.getName() << std::endl;
+			default: return size_t(0);
+		}
+	};
+	auto arrive = [&](size_t stage, size_t passenger){
+		Lines& l = stageLines[stage];
+		if (stages[stage].dispatch == Dispatch::SharedLine)
+		{
+			if (l.freeMachines)
+			{
+				--l.freeMachines;
+				startService(stage, 0, passenger);
 			}
+			else l.lines[0].push_back(passenger);
+			return;
+		}
+		size_t machine = pickLine(stage);
+		if (!l.busy[machine])
+		{
+			l.busy[machine] = true;
+			startService(stage, machine, passenger);
+		}
+		else l.lines[machine].push_back(passenger);
+	};
+	// Only the next arrival is scheduled, it schedules the one after it. When everybody is
+	// there at 0 they just line up, a million arrival events would only cost time.
+	if (arrivals.simultaneous()) for (size_t i = 0; i < numberOfPassengers; i++) arrive(0, i);
+	else if (numberOfPassengers) sim.schedule_at(arrivals.next(0, 0, rng), Event{true, 0, 0, 0});
 
-			// After processing done pass it to next stage
-			callback(person);
-		});
+	// A passenger can leave at 0 (zero service times), so minutes == 0 doesn't mean nobody left yet
+	bool anybodyOut = false;
+	double firstOut = 0;
+	double latencySum = 0;
+	double waitSum = 0;
+	vector<double> latencies, waits;
+	latencies.reserve(numberOfPassengers);
+	waits.reserve(numberOfPassengers);
+	result.minLatency = numeric_limits<double>::infinity();
+	sim.run([&](const Event& done){
+		if (done.arrival)
+		{
+			arrivedAt[done.passenger] = sim.now();
+			arrive(0, done.passenger);
+			size_t next = done.passenger + 1;
+			if (next < numberOfPassengers) sim.schedule_at(arrivals.next(next, sim.now(), rng), Event{true, 0, 0, next});
+			return;
+		}
+		// The machine takes the next one in its line or waits
+		Lines& l = stageLines[done.stage];
+		bool shared = stages[done.stage].dispatch == Dispatch::SharedLine;
+		deque<size_t>& line = l.lines[shared ? 0 : done.machine];
+		if (line.empty())
+		{
+			if (shared) ++l.freeMachines;
+			else l.busy[done.machine] = false;
+		}
+		else
+		{
+			startService(done.stage, done.machine, line.front());
+			line.pop_front();
+		}
+		if (done.stage + 1 < stages.size()) arrive(done.stage + 1, done.passenger);
+		else
+		{
+			if (!anybodyOut) firstOut = sim.now();
+			anybodyOut = true;
+			result.minutes = sim.now();
+			double latency = sim.now() - startedAt[done.passenger];
+			latencySum += latency;
+			latencies.push_back(latency);
+			result.minLatency = min(result.minLatency, latency);
+			result.maxLatency = max(result.maxLatency, latency);
+			double wait = sim.now() - arrivedAt[done.passenger] - servedFor[done.passenger];
+			waitSum += wait;
+			waits.push_back(wait);
+			result.maxWait = max(result.maxWait, wait);
+		}
+	});
+
+	// Same rank as the pipeline's trace uses, only partially sorted
+	auto p99 = [](vector<double>& values){
+		auto at = values.begin() + ptrdiff_t(0.99 * double(values.size() - 1));
+		nth_element(values.begin(), at, values.end());
+		return *at;
 	};
-};
+	if (numberOfPassengers)
+	{
+		result.meanLatency = latencySum / double(numberOfPassengers);
+		result.meanWait = waitSum / double(numberOfPassengers);
+		result.p99Latency = p99(latencies);
+		result.p99Wait = p99(waits);
+	}
+	else result.minLatency = 0;
+	if (numberOfPassengers > 1 && result.minutes > firstOut) result.throughput = double(numberOfPassengers - 1) / (result.minutes - firstOut);
+	result.events = sim.processed();
+	return result;
+}
 
-class SecurityCheckStages
+void timeWithSimulation(std::size_t numberOfPassengers, std::size_t numberOfBoardingPassMachines, std::size_t numberOfSecurityMachines)
 {
-private:
-	SecurityCheckStage boardingPassStage;
-	SecurityCheckStage securityCheckStage;
-	std::thread stage_manager;
+	using namespace std;
+	auto start_time = chrono::high_resolution_clock::now();
+	SimulationResult result = simulateAirport(numberOfPassengers, {
+		{"Boarding Pass Check", 1, numberOfBoardingPassMachines},
+		{"Security Check", 10, numberOfSecurityMachines},
+	});
+	chrono::duration<double, milli> duration = chrono::high_resolution_clock::now() - start_time;
+	cout << "Simulated \tPassengers: " << numberOfPassengers << " \tBoardingPassMachines: " << numberOfBoardingPassMachines
+		 << " \tSecurityCheckMachines: " << numberOfSecurityMachines << " \tElapsed: " << fixed << setprecision(0) << result.minutes << "mins."
+		 << " \tThroughput: " << setprecision(3) << result.throughput << "/min (bottleneck " << result.analyticThroughput << "/min)"
+		 << " \t" << result.events << " events in " << duration.count() << "ms" << defaultfloat << setprecision(6) << endl;
+}
 
-public:
-	SecurityCheckStages(
-		std::size_t numberOfBoardingPassMachines = 1,
-		std::size_t numberOfSecurityCheckMachines = 1
-		) :
-			boardingPassStage("Boarding Pass Check", std::chrono::milliseconds(1), numberOfBoardingPassMachines),
-			securityCheckStage("Security Check", std::chrono::milliseconds(10), numberOfSecurityCheckMachines)
-	{
-		// initializer
-		stage_manager = std::thread([this](){
-			manage_security_check_stage_pipeline();
+// Capacity planning: every passengers x boarding machines x security lines combination is its
+// own simulation, they share nothing, so the whole grid runs at once on a thread_pool.
+// Prints one row per configuration and the cheapest balanced one for every passenger count.
+void sweepAirport(const std::vector<std::size_t>& passengerCounts, const std::vector<std::size_t>& boardingPassMachines, const std::vector<std::size_t>& securityMachines)
+{
+	using namespace std;
+	struct Configuration
+	{
+		size_t passengers, boarding, security;
+		SimulationResult result;
+	};
+	vector<Configuration> grid;
+	for (size_t p : passengerCounts)
+		for (size_t b : boardingPassMachines)
+			for (size_t s : securityMachines) grid.push_back(Configuration{p, b, s, {}});
+
+	auto start_time = chrono::high_resolution_clock::now();
+	thread_pool pool;
+	for (Configuration& c : grid)
+	{
+		pool.do_work([&c](){
+			c.result = simulateAirport(c.passengers, {{"Boarding Pass Check", 1, c.boarding}, {"Security Check", 10, c.security}});
 		});
 	}
-	~SecurityCheckStages() {
-		if (stage_manager.joinable()) stage_manager.join();
-	};
+	pool.wait_idle();
+	chrono::duration<double, milli> duration = chrono::high_resolution_clock::now() - start_time;
 
-	void manage_security_check_stage_pipeline(){
-		// Enqueue all passengers to boarding pass check
-		for (auto person : passengers) {
-			std::lock_guard<std::mutex> guard(mtx_atBoardingPassCheck);
-			atBoardingPassCheck.push(person);
-			cv_atBoardingPassCheck.notify_one();
-
-			boardingPassStage.process_person(person, [](Person person){
-				// After processing done remove it from boarding pass check queue
-				{
-					std::lock_guard<std::mutex> guard(mtx_atBoardingPassCheck);
-					atBoardingPassCheck.pop();
-					if (atBoardingPassCheck.empty()) isBoardingPassCheckDone = true;
-				}
-				cv_atBoardingPassCheck.notify_one();
-
-				// Pass it to security check
-				{
-					std::lock_guard<std::mutex> guard(mtx_atSecurityCheck);
-					atSecurityCheck.push(person);
-				}
-				cv_atSecurityCheck.notify_one();
-			});
-		};
+	cout << left << setw(12) << "passengers" << setw(10) << "boarding" << setw(10) << "security" << right
+		 << setw(12) << "mins" << setw(14) << "persons/min" << setw(14) << "bottleneck" << setw(14) << "mean latency" << setw(13) << "max latency" << "  balanced" << endl;
+	cout << fixed;
+	for (const Configuration& c : grid)
+	{
+		const SimulationResult& r = c.result;
+		cout << left << setw(12) << c.passengers << setw(10) << c.boarding << setw(10) << c.security << right
+			 << setprecision(0) << setw(12) << r.minutes << setprecision(3) << setw(14) << r.throughput << setw(14) << r.analyticThroughput
+			 << setprecision(1) << setw(14) << r.meanLatency << setw(13) << r.maxLatency << "  " << (r.balanced() ? "yes" : "no") << endl;
+	}
+	for (size_t p : passengerCounts)
+	{
+		const Configuration* best = nullptr;
+		for (const Configuration& c : grid)
+		{
+			if (c.passengers != p || !c.result.balanced()) continue;
+			if (!best || c.boarding + c.security < best->boarding + best->security) best = &c;
+		}
+		if (best) cout << p << " passengers: " << best->boarding << " boarding pass machines and " << best->security << " security lines are balanced" << endl;
+		else cout << p << " passengers: no balanced configuration in the grid" << endl;
+	}
+	cout << grid.size() << " configurations in " << duration.count() << "ms on " << pool.size() << " threads" << defaultfloat << setprecision(6) << endl << endl;
+}
 
-		// Whenever a person is put on security check queue, process it
-		while (!isSecurityCheckDone && !isBoardingPassCheckDone){
-			Person person{"Unknown"};
-			{
-				std::unique_lock<std::mutex> guard(mtx_atSecurityCheck);
-				// wait until there is some work to do or all passengers are processed
-				cv_atSecurityCheck.wait(guard, [](){ return (!atSecurityCheck.empty() || (isSecurityCheckDone && isBoardingPassCheckDone)); });
-				if (isSecurityCheckDone && isBoardingPassCheckDone) break;
-				if (!atSecurityCheck.empty()){
-					person = atSecurityCheck.front();
-					atSecurityCheck.pop();
-				}
-			}
+// Many seeded replications of one stochastic scenario at once on a thread_pool, every one a
+// whole simulated day. Prints the mean of each replication's throughput and wait with a 95%
+// confidence interval across the replications.
+void monteCarloAirport(const std::string& scenario, std::size_t replications, std::size_t numberOfPassengers,
+	const arrival_process& arrivals, const std::vector<SimulatedStage>& stages)
+{
+	using namespace std;
+	thread_pool pool;
+	auto start_time = chrono::high_resolution_clock::now();
+	vector<SimulationResult> results = replicate(pool, replications, 2024, [&](uint64_t seed){
+		return simulateAirport(numberOfPassengers, stages, arrivals, seed);
+	});
+	chrono::duration<double, milli> duration = chrono::high_resolution_clock::now() - start_time;
+
+	vector<double> throughputs, waits, maxWaits;
+	for (const SimulationResult& r : results)
+	{
+		throughputs.push_back(r.throughput);
+		waits.push_back(r.meanWait);
+		maxWaits.push_back(r.maxWait);
+	}
+	estimate throughput = estimate_of(throughputs), wait = estimate_of(waits), maxWait = estimate_of(maxWaits);
+	cout << fixed << setprecision(3) << left << setw(44) << scenario << right
+		 << " \tThroughput: " << throughput.mean << " +- " << throughput.half_width << "/min"
+		 << " (bottleneck " << results.front().analyticThroughput << "/min)" << setprecision(1)
+		 << " \tWait: " << wait.mean << " +- " << wait.half_width << "mins, worst " << maxWait.mean << " +- " << maxWait.half_width
+		 << " \t" << replications << " x " << numberOfPassengers << " passengers in " << duration.count() << "ms"
+		 << defaultfloat << setprecision(6) << endl;
+}
 
+// A day of checkpoint traffic from a file instead of a loop: `rows` Poisson arrivals (0.9 a
+// minute, every tenth passenger flagged for the priority lane) are written as CSV and binary
+// traces and read back, once line by line with iostreams and once memory-mapped and parsed
+// in parallel. Then the whole trace goes through the simulation at its recorded times.
+// Returns the trace for replaying it in real time.
+std::vector<arrival_record> timeWithArrivalTrace(std::size_t rows)
+{
+	using namespace std;
+	vector<arrival_record> day(rows);
+	mt19937_64 rng(7);
+	arrival_process arrivals = arrival_process::poisson(0.9);
+	double time = 0;
+	for (size_t i = 0; i < rows; i++)
+	{
+		time = arrivals.next(i, time, rng);
+		day[i] = arrival_record{time, 100000 + i, uint32_t(i % 10 == 0)};
+	}
+	filesystem::path csv = filesystem::temp_directory_path() / "airport_arrivals.csv";
+	filesystem::path binary = filesystem::temp_directory_path() / "airport_arrivals.bin";
+	save_arrival_trace(csv.string(), day, trace_format::csv);
+	save_arrival_trace(binary.string(), day, trace_format::binary);
 
-			securityCheckStage.process_person(person, [](Person person){
-				// After processing done remove it from security check queue
-				{
-					if (atSecurityCheck.empty()) isSecurityCheckDone = true;
-					else {
-						std::lock_guard<std::mutex> guard(mtx_atSecurityCheck);
-						atSecurityCheck.pop();
-					}
-				}
-				cv_atSecurityCheck.notify_one();
-			});
-			
-
-			// If all passengers are processed then stop the thread
-			// if (isBoardingPassCheckDone && isSecurityCheckDone) break;
+	auto timed = [](auto&& load){
+		auto start_time = chrono::high_resolution_clock::now();
+		vector<arrival_record> records = load();
+		chrono::duration<double, milli> duration = chrono::high_resolution_clock::now() - start_time;
+		return make_pair(std::move(records), duration.count());
+	};
+	auto [streamed, streamedMs] = timed([&csv](){
+		vector<arrival_record> records;
+		ifstream in(csv);
+		string line;
+		getline(in, line); // header
+		while (getline(in, line))
+		{
+			istringstream fields(line);
+			arrival_record r{};
+			char comma;
+			fields >> r.time >> comma >> r.passenger >> comma >> r.flags;
+			records.push_back(r);
 		}
+		return records;
+	});
+	thread_pool pool;
+	auto [parsed, parsedMs] = timed([&](){ return load_arrival_trace(pool, csv.string()); });
+	auto [mapped, mappedMs] = timed([&](){ return load_arrival_trace(pool, binary.string()); });
+	filesystem::remove(csv);
+	filesystem::remove(binary);
+	if (parsed.size() != rows || mapped.size() != rows || streamed.size() != rows) throw runtime_error("The arrival trace didn't survive the round trip.");
+
+	size_t flagged = 0;
+	vector<double> times;
+	times.reserve(parsed.size());
+	for (const arrival_record& arrival : parsed)
+	{
+		flagged += arrival.flags & 1;
+		times.push_back(arrival.time);
 	}
-};
+	cout << fixed << setprecision(0) << "Arrival trace of " << rows << " passengers (" << flagged << " priority) over " << parsed.back().time << "mins"
+		 << " 	iostream: " << streamedMs << "ms 	mapped CSV on " << pool.size() << " threads: " << parsedMs << "ms 	mapped binary: " << mappedMs << "ms" << endl;
 
-void timeWithNumberOfMachines(std::size_t numberOfPassengers, std::size_t numberOfBoardingPassMachines, std::size_t numberOfSecurityMachines)
+	auto start_time = chrono::high_resolution_clock::now();
+	SimulationResult result = simulateAirport(rows, {
+		{"Boarding Pass Check", service_distribution::exponential(1), 1},
+		{"Security Check", service_distribution::lognormal(10, 0.5), 10},
+	}, arrival_process::recorded(std::move(times)));
+	chrono::duration<double, milli> duration = chrono::high_resolution_clock::now() - start_time;
+	cout << "Replayed in simulation 	Throughput: " << setprecision(3) << result.throughput << "/min 	Wait: " << setprecision(1) << result.meanWait
+		 << "mins, p99 " << result.p99Wait << "mins 	" << result.events << " events in " << setprecision(0) << duration.count() << "ms"
+		 << defaultfloat << setprecision(6) << endl << endl;
+	return parsed;
+}
+
+// Every dispatch policy for `lines` security machines, kept 90% busy by Poisson arrivals and
+// lognormal service times, each with the same replications and seeds. The mean wait hardly
+// tells them apart, the p99 does: with a line per machine a passenger can get stuck behind a
+// slow check while the next line is empty.
+void compareDispatch(std::size_t lines, std::size_t replications, std::size_t numberOfPassengers)
 {
 	using namespace std;
-	// Populate airport with few people
-	for (size_t i = 1; i <= numberOfPassengers; i++)
+	thread_pool pool;
+	arrival_process arrivals = arrival_process::poisson(0.9 * double(lines) / 10);
+	cout << lines << " security lines, " << replications << " x " << numberOfPassengers << " passengers" << endl;
+	cout << left << setw(24) << "(mins)" << right << setw(18) << "mean wait" << setw(18) << "p99 wait" << setw(18) << "p99 latency" << setw(12) << "worst" << endl;
+	vector<pair<Dispatch, estimate>> p99s;
+	for (Dispatch dispatch : {Dispatch::SharedLine, Dispatch::RoundRobin, Dispatch::JoinShortestLine, Dispatch::PowerOfTwoChoices})
+	{
+		const vector<SimulatedStage> stages = {
+			{"Boarding Pass Check", service_distribution::exponential(1), 1},
+			{"Security Check", service_distribution::lognormal(10, 0.5), lines, dispatch},
+		};
+		vector<SimulationResult> results = replicate(pool, replications, 2024, [&](uint64_t seed){
+			return simulateAirport(numberOfPassengers, stages, arrivals, seed);
+		});
+		vector<double> waits, p99Waits, p99Latencies, maxWaits;
+		for (const SimulationResult& r : results)
+		{
+			waits.push_back(r.meanWait);
+			p99Waits.push_back(r.p99Wait);
+			p99Latencies.push_back(r.p99Latency);
+			maxWaits.push_back(r.maxWait);
+		}
+		estimate wait = estimate_of(waits), p99Wait = estimate_of(p99Waits), p99Latency = estimate_of(p99Latencies);
+		auto withInterval = [](const estimate& e){
+			ostringstream text;
+			text << fixed << setprecision(1) << e.mean << " +- " << e.half_width;
+			return text.str();
+		};
+		cout << left << setw(24) << dispatchName(dispatch) << right << setw(18) << withInterval(wait) << setw(18) << withInterval(p99Wait)
+			 << setw(18) << withInterval(p99Latency) << setw(12) << fixed << setprecision(1) << estimate_of(maxWaits).mean << defaultfloat << setprecision(6) << endl;
+		p99s.emplace_back(dispatch, p99Wait);
+	}
+	auto best = min_element(p99s.begin(), p99s.end(), [](const auto& a, const auto& b){ return a.second.mean < b.second.mean; });
+	cout << "Best p99 wait with " << lines << " lines: " << dispatchName(best->first);
+	// Replications can't tell policies apart whose intervals overlap
+	const char* separator = " (too close to call against ";
+	for (const auto& [dispatch, p99Wait] : p99s)
 	{
-		Person person = Person(std::string("Person ") + std::to_string(i));
-		passengers.push_back(person);
+		if (dispatch == best->first || p99Wait.low() > best->second.high()) continue;
+		cout << separator << dispatchName(dispatch);
+		separator = ", ";
 	}
-	PROGRAM_START_TIME = chrono::high_resolution_clock::now();
+	if (separator[0] == ',') cout << ")";
+	cout << endl << endl;
+}
+
+// Passengers flow through the stages in order through bounded channels, a stage serves as
+// many passengers at once as it has machines and the end of the stream (the last passenger)
+// travels down the stages by itself, no manager thread or shared flags needed. Service
+// times are drawn from the stages' distributions. The machines of a stage always share one
+// line here, `dispatch` is only simulated.
+// With a `machineBudget` the machine counts are only where the day starts: staff moves
+// between the stages to wherever the line is the bottleneck, never more than the budget at once.
+// Everybody is there at the start, unless `arrivals` is given: then the first passengers of
+// that trace show up at their recorded minutes. Returns the steady-state throughput in
+// passengers a minute, without the first and last tenth of them (filling up and draining).
+double timeWithStages(const std::vector<SimulatedStage>& stages, std::size_t numberOfPassengers, std::size_t machineBudget = 0,
+	std::span<const arrival_record> arrivals = {})
+{
+	using namespace std;
+	using Id = PassengerStore::Id;
+	if (stages.empty()) throw invalid_argument("The airport needs at least one stage.");
+	PassengerStore passengers(stages.size());
+	Id first = 0;
+	if (arrivals.empty()) first = passengers.addNumbered("Person ", numberOfPassengers);
+	else
+	{
+		arrivals = arrivals.first(min(numberOfPassengers, arrivals.size()));
+		numberOfPassengers = arrivals.size();
+		for (const arrival_record& arrival : arrivals) passengers.add("Passenger " + to_string(arrival.passenger));
+	}
+
+	// Only passenger ids travel between the stages. A busy machine is a pending timer, so a
+	// stage needs its two pipeline threads however many machines it has
+	thread_pool pool(1);
+	timer_queue timers(pool, chrono::microseconds(100));
 	auto start_time = chrono::high_resolution_clock::now();
+	auto machine = [&passengers, &stages, &timers, start_time](size_t stage){
+		return [&passengers, &stages, &timers, start_time, stage](Id passenger, auto done){
+			thread_local mt19937_64 rng(random_device{}());
+			chrono::duration<double, milli> minutes(stages[stage].minutesPerPerson(rng));
+			serve(timers, passengers, stage, stages[stage].name.c_str(), minutes, passenger, start_time, [done, passenger](){ done(passenger); });
+		};
+	};
+	pipeline<Id> airport(64);
+	for (size_t stage = 0; stage + 1 < stages.size(); stage++) airport = airport.then_async(stages[stage].name, stages[stage].machines, machine(stage));
+	auto checks = airport.then_async<void>(stages.back().name, stages.back().machines, [last = machine(stages.size() - 1)](Id passenger, stage_done<void> done){
+		last(passenger, [done](Id){ done(); });
+	});
+	if (machineBudget) checks.auto_balance(machineBudget, chrono::milliseconds(1) * scaleFactor);
+	checks.enable_tracing();
+	checks.start();
+
+	if (arrivals.empty())
 	{
-		SecurityCheckStages securityChecks{numberOfBoardingPassMachines, numberOfSecurityMachines};
+		for (Id passenger = first; passenger < first + numberOfPassengers; passenger++)
+		{
+			checks.push(passenger);
+		}
+	}
+	else
+	{
+		Id next = first;
+		replay_arrivals(arrivals, chrono::milliseconds(1) * scaleFactor, [&checks, &next](const arrival_record&){ checks.push(next++); });
 	}
+	checks.close();
+	checks.wait();
 	auto end_time = chrono::high_resolution_clock::now();
+	logger.flush(); // the machines' lines come before the summary
 	auto duration = chrono::duration_cast<chrono::milliseconds>(end_time - start_time);
 	long long scaledTime = duration.count() / scaleFactor;
+	double throughput = double(numberOfPassengers) / double(max<long long>(scaledTime, 1));
 	cout << "==============================================================================================================" << endl;
 
-	cout << "Passengers: "<<numberOfPassengers << " \tBoardingPassMachines: "<<numberOfBoardingPassMachines << " \tSecurityCheckMachines: "<< numberOfSecurityMachines << " \tElapsed: " << scaledTime << "mins." << endl;
+	cout << "Passengers: " << numberOfPassengers;
+	for (const SimulatedStage& stage : stages) cout << " \t" << stage.name << ": " << stage.machines;
+	cout << " \tElapsed: " << scaledTime << "mins." << " \tThroughput: " << throughput << "/min" << endl;
+	if (machineBudget)
+	{
+		cout << "Rebalanced " << checks.rebalances() << " times within a budget of " << machineBudget << " machines, ended with";
+		for (const stage_stats& stage : checks.stats()) cout << " \t" << stage.name << ": " << stage.workers << " (" << stage.mean_service_ms << "ms)";
+		cout << endl;
+	}
+	trace_report trace = checks.trace();
+	printTrace(trace);
+	cout << "==============================================================================================================" << endl << endl;
+	return trace.steady_throughput * double(scaleFactor) / 1000.0;
+}
+
+// The airport of the header comment, a minute at the boarding pass machines and ten at security
+void timeWithNumberOfMachines(std::size_t numberOfPassengers, std::size_t numberOfBoardingPassMachines, std::size_t numberOfSecurityMachines, std::size_t machineBudget = 0,
+	std::span<const arrival_record> arrivals = {})
+{
+	timeWithStages({{"Boarding Pass Check", 1, numberOfBoardingPassMachines}, {"Security Check", 10, numberOfSecurityMachines}}, numberOfPassengers, machineBudget, arrivals);
+}
+
+// The stages from a file, one per line and in the order passengers go through them:
+//     name | minutes per person | machines [| dispatch]
+// The minutes are anything service_distribution::parse() reads, the dispatch is shared (the
+// default), round-robin, shortest or two-choices. '#' starts a comment.
+std::vector<SimulatedStage> loadStages(const std::string& path)
+{
+	using namespace std;
+	ifstream in(path);
+	if (!in) throw runtime_error("Can't open " + path + ".");
+	auto trim = [](string_view text){
+		size_t begin = text.find_first_not_of(" \t\r");
+		if (begin == string_view::npos) return string_view();
+		return text.substr(begin, text.find_last_not_of(" \t\r") - begin + 1);
+	};
+	vector<SimulatedStage> stages;
+	string line;
+	for (size_t number = 1; getline(in, line); number++)
+	{
+		string_view text = trim(string_view(line).substr(0, line.find('#')));
+		if (text.empty()) continue;
+		vector<string_view> fields;
+		for (size_t at = 0; at <= text.size();)
+		{
+			size_t bar = min(text.find('|', at), text.size());
+			fields.push_back(trim(text.substr(at, bar - at)));
+			at = bar + 1;
+		}
+		auto fail = [&](const string& why){ return runtime_error(path + ":" + to_string(number) + ": " + why); };
+		if (fields.size() < 3 || fields.size() > 4 || fields[0].empty()) throw fail("expected name | minutes per person | machines [| dispatch]");
+		SimulatedStage stage{string(fields[0]), 1, 0};
+		try
+		{
+			stage.minutesPerPerson = service_distribution::parse(fields[1]);
+		}
+		catch (const invalid_argument& e)
+		{
+			throw fail(e.what());
+		}
+		auto [end, error] = from_chars(fields[2].data(), fields[2].data() + fields[2].size(), stage.machines);
+		if (error != errc() || end != fields[2].data() + fields[2].size() || !stage.machines) throw fail("the machine count must be a positive number");
+		if (fields.size() == 4)
+		{
+			if (fields[3] == "shared") stage.dispatch = Dispatch::SharedLine;
+			else if (fields[3] == "round-robin") stage.dispatch = Dispatch::RoundRobin;
+			else if (fields[3] == "shortest") stage.dispatch = Dispatch::JoinShortestLine;
+			else if (fields[3] == "two-choices") stage.dispatch = Dispatch::PowerOfTwoChoices;
+			else throw fail("unknown dispatch " + string(fields[3]));
+		}
+		stages.push_back(std::move(stage));
+	}
+	if (stages.empty()) throw runtime_error(path + " has no stages.");
+	return stages;
+}
+
+// What queueing theory says before anything runs. Every stage is a G/G/c queue: the Erlang C
+// wait of c machines scaled by how variable arrivals and services are (Allen-Cunneen), and what
+// leaves one stage arrives at the next (the linking equation of Whitt's QNA). Exact for fixed
+// times and all-at-once arrivals once past the first few passengers, an approximation
+// otherwise. Every dispatch policy is treated like the shared line, the others can only be worse.
+struct Prediction
+{
+	double throughput = 0;           // passengers per minute in the long run
+	std::size_t bottleneck = 0;      // the stage with the least capacity, machines / mean time
+	std::vector<double> utilization; // how busy each stage's machines are
+	// Minutes in lines and from arriving to getting through, per passenger in the steady
+	// state. Infinite when more arrive than the bottleneck can take, the line only grows.
+	double meanWait = 0;
+	double meanLatency = 0;
+	double minutes = 0;              // until the last passenger is through
+
+	bool saturated() const { return std::isinf(meanWait); }
+};
 
+Prediction predictAirport(const std::vector<SimulatedStage>& stages, const arrival_process& arrivals, std::size_t numberOfPassengers)
+{
+	using namespace std;
+	if (stages.empty()) throw invalid_argument("The airport needs at least one stage.");
+	Prediction p;
+	double capacity = numeric_limits<double>::infinity();
+	double service = 0;
+	for (size_t i = 0; i < stages.size(); i++)
 	{
-		// Reset values
-		std::lock_guard<std::mutex> guard(mtx_atBoardingPassCheck);
-		std::lock_guard<std::mutex> guard2(mtx_atSecurityCheck);
-		std::lock_guard<std::mutex> guard3(mtx_enteredAirport);
-		passengers.clear();
-		atBoardingPassCheck = std::queue<Person>();
-		atSecurityCheck = std::queue<Person>();
-		enteredAirport = std::queue<Person>();
-		isBoardingPassCheckDone = false;
-		isSecurityCheckDone = false;
-		isAllChecksDone = false;
+		double c = double(stages[i].machines) / stages[i].minutesPerPerson.mean();
+		if (c < capacity)
+		{
+			capacity = c;
+			p.bottleneck = i;
+		}
+		service += stages[i].minutesPerPerson.mean();
+	}
+	double rate = arrivals.rate();
+	p.throughput = min(rate, capacity);
+	for (const SimulatedStage& stage : stages) p.utilization.push_back(p.throughput * stage.minutesPerPerson.mean() / double(stage.machines));
+	double remaining = numberOfPassengers ? double(numberOfPassengers - 1) : 0;
+	if (rate >= capacity)
+	{
+		p.meanWait = p.meanLatency = numeric_limits<double>::infinity();
+		p.minutes = service + remaining / p.throughput;
+		return p;
 	}
 
+	double ca2 = arrivals.scv();
+	for (const SimulatedStage& stage : stages)
 	{
-		std::lock_guard<std::mutex> guard(cout_lock);
-		cout << "==============================================================================================================" << endl << endl;
+		double c = double(stage.machines);
+		double s = stage.minutesPerPerson.mean();
+		double offered = rate * s;
+		double rho = offered / c;
+		// Erlang B by recursion over the machines, then C: the chance that all of them are busy
+		double blocked = 1;
+		for (size_t k = 1; k <= stage.machines; k++) blocked = offered * blocked / (double(k) + offered * blocked);
+		double allBusy = blocked / (1 - rho * (1 - blocked));
+		double cs2 = stage.minutesPerPerson.scv();
+		p.meanWait += allBusy * s / (c * (1 - rho)) * (ca2 + cs2) / 2;
+		ca2 = 1 + (1 - rho * rho) * (ca2 - 1) + rho * rho * (cs2 - 1) / sqrt(c);
 	}
+	p.meanLatency = p.meanWait + service;
+	p.minutes = remaining / rate + p.meanLatency;
+	return p;
+}
+
+// Prints one measured number next to its prediction, flagged when it is more than
+// `tolerance` (relative) off. Returns whether it was.
+bool checkPrediction(const char* what, double predicted, double measured, double tolerance)
+{
+	using namespace std;
+	double off = predicted != 0 ? (measured - predicted) / predicted : measured;
+	bool deviates = abs(off) > tolerance;
+	cout << "  " << left << setw(12) << what << right << fixed << setprecision(3) << setw(14) << predicted << setw(14) << measured
+		 << setprecision(1) << showpos << setw(9) << off * 100 << "%" << noshowpos << (deviates ? "  <-- differs from the prediction" : "")
+		 << defaultfloat << setprecision(6) << endl;
+	return deviates;
 }
 
-int main()
+// Capacity planning from a stage file: the prediction takes microseconds, the simulation of
+// `numberOfPassengers` then checks it. Steady-state waits are only compared when there is a
+// steady state, with everybody at once or too many arrivals the line just grows.
+void planAirport(const std::string& path, std::size_t numberOfPassengers, const arrival_process& arrivals, double tolerance = 0.1)
 {
+	using namespace std;
+	vector<SimulatedStage> stages = loadStages(path);
+	auto start_time = chrono::high_resolution_clock::now();
+	Prediction prediction = predictAirport(stages, arrivals, numberOfPassengers);
+	chrono::duration<double, micro> predicted = chrono::high_resolution_clock::now() - start_time;
+
+	cout << path << ": " << numberOfPassengers << " passengers";
+	if (arrivals.simultaneous()) cout << " all at once";
+	else cout << ", " << arrivals.rate() << " a minute";
+	cout << endl << fixed << setprecision(0);
+	for (size_t i = 0; i < stages.size(); i++)
+	{
+		cout << "  " << left << setw(24) << stages[i].name << right << setw(4) << stages[i].machines << " x " << setprecision(2) << stages[i].minutesPerPerson.mean()
+			 << "mins \t" << setprecision(0) << prediction.utilization[i] * 100 << "% busy" << (i == prediction.bottleneck ? " \tbottleneck" : "") << endl;
+	}
+	cout << "Predicted in " << setprecision(1) << predicted.count() << "us, simulated in ";
+	start_time = chrono::high_resolution_clock::now();
+	SimulationResult result = simulateAirport(numberOfPassengers, stages, arrivals);
+	chrono::duration<double, milli> simulated = chrono::high_resolution_clock::now() - start_time;
+	cout << simulated.count() << "ms" << defaultfloat << setprecision(6) << endl;
+	cout << "  " << left << setw(12) << "" << right << setw(14) << "predicted" << setw(14) << "simulated" << setw(10) << "off" << endl;
+
+	checkPrediction("persons/min", prediction.throughput, result.throughput, tolerance);
+	checkPrediction("mins", prediction.minutes, result.minutes, tolerance);
+	if (!prediction.saturated()) checkPrediction("mean wait", prediction.meanWait, result.meanWait, tolerance);
+	cout << endl;
+}
+
+// ./airport stages-file [passengers [arrivals a minute]] only plans that airport
+int main(int argc, char* argv[])
+{
+	if (argc > 1)
+	{
+		try
+		{
+			std::size_t numberOfPassengers = argc > 2 ? std::stoul(argv[2]) : 100000;
+			arrival_process arrivals = argc > 3 ? arrival_process::poisson(std::stod(argv[3])) : arrival_process::all_at_once();
+			planAirport(argv[1], numberOfPassengers, arrivals);
+		}
+		catch (const std::exception& e)
+		{
+			std::cerr << e.what() << std::endl;
+			return 1;
+		}
+		return 0;
+	}
+
+
+	// Virtual time, exact answers: 41, 22 and 14 minutes like the header comment says, and with
+	// enough passengers the throughput settles at what the bottleneck stage can do
+	timeWithSimulation(4, 1, 1);
+	timeWithSimulation(4, 1, 2);
+	timeWithSimulation(4, 1, 4);
+	timeWithSimulation(200, 1, 1);
+	timeWithSimulation(2000, 100, 1000);
+	timeWithSimulation(1000000, 1, 4);
+	timeWithSimulation(1000000, 1, 10);
+	sweepAirport({1000, 100000}, {1, 2}, {1, 2, 4, 8, 10, 16, 20});
+
+	// 0.9 passengers a minute on average into the balanced 1/10 airport, in different ways
+	const std::vector<SimulatedStage> fixedTimes = {{"Boarding Pass Check", 1, 1}, {"Security Check", 10, 10}};
+	const std::vector<SimulatedStage> randomTimes = {
+		{"Boarding Pass Check", service_distribution::exponential(1), 1},
+		{"Security Check", service_distribution::lognormal(10, 0.5), 10},
+	};
+	const std::vector<SimulatedStage> measuredTimes = {
+		{"Boarding Pass Check", 1, 1},
+		{"Security Check", service_distribution::empirical({6, 7, 8, 9, 10, 10, 10, 11, 12, 17}), 10},
+	};
+	monteCarloAirport("Poisson, fixed service", 100, 10000, arrival_process::poisson(0.9), fixedTimes);
+	monteCarloAirport("Poisson, exponential/lognormal service", 100, 10000, arrival_process::poisson(0.9), randomTimes);
+	monteCarloAirport("Poisson, measured security times", 100, 10000, arrival_process::poisson(0.9), measuredTimes);
+	monteCarloAirport("Groups of 20, fixed service", 100, 10000, arrival_process::bursty(0.045, 20), fixedTimes);
+	monteCarloAirport("Waves of 90 every 100 mins, fixed service", 100, 10000, arrival_process::waves(90, 100), fixedTimes);
+	std::cout << std::endl;
+
+	// One shared line or a line per machine, and how to pick one
+	compareDispatch(2, 100, 10000);
+	compareDispatch(4, 100, 10000);
+	compareDispatch(10, 100, 10000);
+
+	// The airport from airport.stages, predicted and then simulated: Poisson arrivals have a
+	// steady state to compare, everybody at once or 1.2 a minute only overload the bottleneck.
+	// Groups of 20 are too bursty for the approximation, the check flags its wait.
+	planAirport("airport.stages", 100000, arrival_process::poisson(0.9));
+	planAirport("airport.stages", 100000, arrival_process::all_at_once());
+	planAirport("airport.stages", 100000, arrival_process::poisson(1.2));
+	planAirport("airport.stages", 100000, arrival_process::bursty(0.045, 20));
+
+	// Millions of rows from a file, then a few hundred of them in real time (further down)
+	std::vector<arrival_record> arrivalTrace = timeWithArrivalTrace(2000000);
+
+	// Should match the header comment: 41, 22 and 14 minutes
+	timeWithTaskGraph(4, 1, 1);
+	timeWithTaskGraph(4, 1, 2);
+	timeWithTaskGraph(4, 1, 4);
+	timeWithCoroutines(4, 1, 1);
+	timeWithCoroutines(4, 1, 4);
+	// 110 machines on 2 threads: 20 mins of scanning, then the last passenger's 10 min check
+	timeWithCoroutines(200, 10, 100);
+
 	// timeWithNumberOfMachines(4, 1, 1);
 	// timeWithNumberOfMachines(4, 1, 2);
 	// timeWithNumberOfMachines(4, 1, 3);
@@ -447,5 +1204,34 @@ int main()
 	// timeWithNumberOfMachines(10, 1, 10);
 	// timeWithNumberOfMachines(20, 1, 10);
 	timeWithNumberOfMachines(200, 1, 1);
+
+	timeHandOff(1000000);
+
+	// Balanced: the security check queueing stays at 0, latency after the boarding line is constant
+	DEBUG = false;
+	timeWithNumberOfMachines(100, 1, 10);
+
+	// The same 11 machines split 6/5 stay unbalanced, moved to the bottleneck they approach 1/10
+	timeWithNumberOfMachines(100, 6, 5);
+	timeWithNumberOfMachines(100, 6, 5, 11);
+
+	// The first 200 passengers of the trace when it says they arrive. 0.9 a minute keeps the
+	// one boarding pass machine 90% busy, its line is where the waiting happens
+	timeWithNumberOfMachines(200, 1, 10, 0, arrivalTrace);
+
+	// The stages of airport.stages as threads against the prediction. Only the steady state is
+	// compared, the total time also has the first passenger going through every stage alone.
+	// The middle 80 passengers' random service times at the bottleneck still move it around,
+	// so the tolerance is three standard errors of their mean
+	const std::vector<SimulatedStage> configured = loadStages("airport.stages");
+	Prediction prediction = predictAirport(configured, arrival_process::all_at_once(), 100);
+	double measured = timeWithStages(configured, 100);
+	double tolerance = 3 * std::sqrt(configured[prediction.bottleneck].minutesPerPerson.scv() / 80);
+	checkPrediction("persons/min", prediction.throughput, measured, std::max(tolerance, 0.1));
+	std::cout << std::endl;
+
+	// 1100 machines, the pipeline still runs on two threads a stage and the coroutines on 2
+	timeWithNumberOfMachines(2000, 100, 1000);
+	timeWithCoroutines(2000, 100, 1000);
 	return 0;
 }
@@ -0,0 +1,256 @@
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "threadpool.hpp"
+
+
+// One row of an arrival trace. `time` is in whatever unit the trace was recorded in (the
+// airport uses minutes), `flags` is free for the model to interpret.
+struct arrival_record{
+	double time;
+	std::uint64_t passenger;
+	std::uint32_t flags;
+	std::uint32_t reserved = 0;
+};
+static_assert(sizeof(arrival_record) == 24);
+
+// csv     "time,passenger[,flags]" per line, an optional header line, '#' starts a comment
+// binary  "ARRIVALS", the record count as uint64, then the records as they are in memory
+//         (little endian, 24 bytes each)
+enum class trace_format { csv, binary };
+
+// A whole file read-only in memory. mmap where there is one, so the pages come in as the
+// parsers touch them and nothing is copied, otherwise the file is read into a buffer.
+class mapped_file{
+	public:
+		explicit mapped_file(const std::string& path){
+#if defined(__unix__) || defined(__APPLE__)
+			int fd = ::open(path.c_str(), O_RDONLY);
+			if (fd < 0) throw std::runtime_error("Can't open " + path + ".");
+			struct stat info;
+			if (::fstat(fd, &info) != 0){
+				::close(fd);
+				throw std::runtime_error("Can't read the size of " + path + ".");
+			}
+			size_ = std::size_t(info.st_size);
+			if (size_){
+				void* data = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+				if (data == MAP_FAILED){
+					::close(fd);
+					throw std::runtime_error("Can't map " + path + ".");
+				}
+				::madvise(data, size_, MADV_SEQUENTIAL);
+				data_ = static_cast<const char*>(data);
+			}
+			::close(fd);
+#else
+			std::ifstream in(path, std::ios::binary | std::ios::ate);
+			if (!in) throw std::runtime_error("Can't open " + path + ".");
+			buffer_.resize(std::size_t(in.tellg()));
+			in.seekg(0);
+			in.read(buffer_.data(), std::streamsize(buffer_.size()));
+			data_ = buffer_.data();
+			size_ = buffer_.size();
+#endif
+		};
+		mapped_file(const mapped_file&) = delete;
+		mapped_file& operator = (const mapped_file&) = delete;
+		~mapped_file(){
+#if defined(__unix__) || defined(__APPLE__)
+			if (data_) ::munmap(const_cast<char*>(data_), size_);
+#endif
+		};
+
+		const char* data() const { return data_; };
+		std::size_t size() const { return size_; };
+		std::string_view view() const { return std::string_view(data_, size_); };
+
+	private:
+		const char* data_ = nullptr;
+		std::size_t size_ = 0;
+#if !defined(__unix__) && !defined(__APPLE__)
+		std::vector<char> buffer_;
+#endif
+};
+
+namespace detail{
+	inline constexpr char trace_magic[8] = {'A', 'R', 'R', 'I', 'V', 'A', 'L', 'S'};
+	inline constexpr std::size_t trace_header = sizeof(trace_magic) + sizeof(std::uint64_t);
+
+	inline std::size_t line_number(std::string_view text, std::size_t offset){
+		return std::size_t(std::count(text.begin(), text.begin() + std::ptrdiff_t(offset), '\n')) + 1;
+	}
+
+	// Parses the whole lines in text[begin, end), `begin` is at the start of a line
+	inline void parse_csv_lines(std::string_view text, std::size_t begin, std::size_t end, const std::string& path, std::vector<arrival_record>& out){
+		const char* p = text.data() + begin;
+		const char* stop = text.data() + end;
+		auto skip_blanks = [&p, stop](){ while (p < stop && (*p == ' ' || *p == '\t')) ++p; };
+		auto fail = [&](){
+			std::size_t at = std::size_t(p - text.data());
+			throw std::runtime_error("Bad arrival record in " + path + " on line " + std::to_string(line_number(text, at)) + ".");
+		};
+		while (p < stop){
+			const char* line_end = static_cast<const char*>(std::memchr(p, '\n', std::size_t(stop - p)));
+			if (!line_end) line_end = stop;
+			skip_blanks();
+			if (p == line_end || *p == '\r' || *p == '#'){
+				if (line_end == stop) break;
+				p = line_end + 1;
+				continue;
+			}
+			arrival_record r{};
+			auto [after_time, time_error] = std::from_chars(p, line_end, r.time);
+			if (time_error != std::errc()) fail();
+			p = after_time;
+			skip_blanks();
+			if (p == line_end || *p != ',') fail();
+			++p;
+			skip_blanks();
+			auto [after_id, id_error] = std::from_chars(p, line_end, r.passenger);
+			if (id_error != std::errc()) fail();
+			p = after_id;
+			skip_blanks();
+			if (p < line_end && *p == ','){
+				++p;
+				skip_blanks();
+				auto [after_flags, flags_error] = std::from_chars(p, line_end, r.flags);
+				if (flags_error != std::errc()) fail();
+				p = after_flags;
+				skip_blanks();
+			}
+			if (p < line_end && *p == '\r') ++p;
+			if (p != line_end) fail();
+			out.push_back(r);
+			if (line_end == stop) break;
+			p = line_end + 1;
+		}
+	}
+}
+
+// Reads a trace in either format (the binary one is recognized by its first bytes) with the
+// work split over the pool: the file is cut into chunks at line boundaries, every chunk is
+// parsed on its own and the pieces are copied into place in parallel. Records come back in
+// time order, a trace that isn't sorted gets sorted (ties keep their order in the file).
+// Throws std::runtime_error naming the line of a bad record.
+inline std::vector<arrival_record> load_arrival_trace(thread_pool& pool, const std::string& path){
+	mapped_file file(path);
+	std::string_view text = file.view();
+	std::vector<arrival_record> records;
+
+	if (text.size() >= detail::trace_header && std::memcmp(text.data(), detail::trace_magic, sizeof(detail::trace_magic)) == 0){
+		std::uint64_t count;
+		std::memcpy(&count, text.data() + sizeof(detail::trace_magic), sizeof(count));
+		if ((text.size() - detail::trace_header) / sizeof(arrival_record) != count || (text.size() - detail::trace_header) % sizeof(arrival_record)){
+			throw std::runtime_error(path + " is cut off or has the wrong record count.");
+		}
+		records.resize(std::size_t(count));
+		const char* source = text.data() + detail::trace_header;
+		pool.parallel_for(0, records.size(), 1 << 16, [&records, source](std::size_t i){
+			std::memcpy(&records[i], source + i * sizeof(arrival_record), sizeof(arrival_record));
+		});
+	} else {
+		// A first line whose time doesn't parse is the header ("nan" and "inf" do parse,
+		// a trace may start with those)
+		std::size_t body = 0;
+		std::size_t first = text.find_first_not_of(" \t");
+		if (first != std::string_view::npos && text[first] != '\n' && text[first] != '\r' && text[first] != '#'){
+			double time;
+			if (std::from_chars(text.data() + first, text.data() + text.size(), time).ec != std::errc()){
+				std::size_t newline = text.find('\n');
+				body = newline == std::string_view::npos ? text.size() : newline + 1;
+			}
+		}
+		// A few chunks per thread so a slow one doesn't hold everybody up
+		std::size_t chunk_count = std::max<std::size_t>(1, std::min(pool.size() * 4, (text.size() - body) / (1 << 16)));
+		std::vector<std::size_t> bounds(chunk_count + 1, text.size());
+		bounds[0] = body;
+		for (std::size_t i=1; i<chunk_count; ++i){
+			std::size_t at = std::max(bounds[i - 1], body + (text.size() - body) / chunk_count * i);
+			std::size_t newline = text.find('\n', at);
+			bounds[i] = newline == std::string_view::npos ? text.size() : newline + 1;
+		}
+		std::vector<std::vector<arrival_record>> pieces(chunk_count);
+		pool.parallel_for(0, chunk_count, 1, [&](std::size_t i){
+			// About 20 bytes a line, one allocation instead of growing
+			pieces[i].reserve((bounds[i + 1] - bounds[i]) / 16);
+			detail::parse_csv_lines(text, bounds[i], bounds[i + 1], path, pieces[i]);
+		});
+		std::vector<std::size_t> offsets(chunk_count + 1, 0);
+		for (std::size_t i=0; i<chunk_count; ++i) offsets[i + 1] = offsets[i] + pieces[i].size();
+		records.resize(offsets.back());
+		pool.parallel_for(0, chunk_count, 1, [&](std::size_t i){
+			std::copy(pieces[i].begin(), pieces[i].end(), records.begin() + std::ptrdiff_t(offsets[i]));
+		});
+	}
+
+	auto earlier = [](const arrival_record& a, const arrival_record& b){ return a.time < b.time; };
+	if (!std::is_sorted(records.begin(), records.end(), earlier)) std::stable_sort(records.begin(), records.end(), earlier);
+	return records;
+}
+
+inline void save_arrival_trace(const std::string& path, std::span<const arrival_record> records, trace_format format){
+	std::ofstream out(path, std::ios::binary | std::ios::trunc);
+	if (!out) throw std::runtime_error("Can't write " + path + ".");
+	if (format == trace_format::binary){
+		std::uint64_t count = records.size();
+		out.write(detail::trace_magic, sizeof(detail::trace_magic));
+		out.write(reinterpret_cast<const char*>(&count), sizeof(count));
+		out.write(reinterpret_cast<const char*>(records.data()), std::streamsize(records.size_bytes()));
+	} else {
+		std::string text = "time,passenger,flags\n";
+		char number[32];
+		for (const arrival_record& r : records){
+			text.append(number, std::to_chars(number, number + sizeof(number), r.time).ptr);
+			text += ',';
+			text.append(number, std::to_chars(number, number + sizeof(number), r.passenger).ptr);
+			text += ',';
+			text.append(number, std::to_chars(number, number + sizeof(number), r.flags).ptr);
+			text += '\n';
+			if (text.size() > (1 << 20)){
+				out.write(text.data(), std::streamsize(text.size()));
+				text.clear();
+			}
+		}
+		out.write(text.data(), std::streamsize(text.size()));
+	}
+	if (!out) throw std::runtime_error("Can't write " + path + ".");
+}
+
+// Calls f(record) for every record when its time comes, `time_unit` of wall clock for one
+// unit of the trace's time, counting from the first record. The records must be in time
+// order. Returns how late the latest call was.
+template <typename F>
+std::chrono::nanoseconds replay_arrivals(std::span<const arrival_record> records, std::chrono::duration<double> time_unit, F&& f){
+	std::chrono::nanoseconds latest{0};
+	if (records.empty()) return latest;
+	auto start = std::chrono::steady_clock::now();
+	double first = records.front().time;
+	for (const arrival_record& r : records){
+		auto due = start + std::chrono::duration_cast<std::chrono::nanoseconds>(time_unit * (r.time - first));
+		std::this_thread::sleep_until(due);
+		latest = std::max(latest, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - due));
+		f(r);
+	}
+	return latest;
+}
@@ -0,0 +1,364 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "mpmc_queue.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+
+// What log() does when the calling thread's buffer is full
+enum class log_overflow { block, drop };
+
+struct logger_options{
+	std::size_t buffer_records = 1024; // per thread, power of two
+	log_overflow when_full = log_overflow::block;
+	bool prefix = true;                // "[seconds since start] (thread) " in front of every line
+	// The writer thread looks for records at least this often, it sleeps longer (up to
+	// 64 times) while nothing gets logged. Only a producer stuck on a full buffer wakes it.
+	std::chrono::microseconds poll_interval{500};
+};
+
+// Logging that keeps formatting and I/O off the threads doing the work.
+// log() packs the format string pointer, a timestamp and the arguments into one fixed-size
+// binary record and puts it into a ring buffer owned by the calling thread (no lock, no
+// allocation, no syscall). A writer thread drains all the buffers, orders a batch by time,
+// formats it and writes it with one call.
+//
+//     async_logger logger;                     // std::cout
+//     logger.log("Deposit {} to {}", 100, name); // "{}" takes the next argument
+//     logger.flush();                          // everything logged so far is written
+//
+// The format string is not copied, pass a string literal. Arguments can be integers, floats,
+// bool, char and strings; strings are copied and cut off when the record is full.
+class async_logger{
+	public:
+		explicit async_logger(std::ostream& out=std::cout, logger_options options={})
+			: out_(out), options_(options), id_(next_logger_id().fetch_add(1)), start_(sample_clock()){
+			if (options_.buffer_records < 2 || (options_.buffer_records & (options_.buffer_records - 1)) != 0){
+				throw std::invalid_argument("The log buffer size must be a power of two.");
+			}
+			writer_ = std::thread([this](){ run(); });
+		};
+		async_logger(const async_logger&) = delete;
+		async_logger& operator = (const async_logger&) = delete;
+		// Writes whatever is still buffered
+		~async_logger(){
+			{
+				std::lock_guard<std::mutex> guard(mtx_);
+				stop_ = true;
+			}
+			cv_.notify_all();
+			writer_.join();
+			// Threads still holding one of our buffers drop it the next time they look one up
+			for (auto& buffer : buffers_) buffer->orphaned.store(true, std::memory_order_release);
+		};
+
+		// False when the record was dropped because the buffer was full (log_overflow::drop)
+		template <typename... Args>
+		bool log(const char* format, const Args&... args){
+			record r;
+			r.ticks = ticks();
+			r.format = format;
+			std::size_t used = 0;
+			(encode(r, used, args), ...);
+			r.size = std::uint16_t(used);
+			buffer_t& buffer = local_buffer();
+			r.thread = buffer.thread;
+			if (buffer.queue.try_push(r)) return true;
+			if (options_.when_full == log_overflow::drop){
+				dropped_.fetch_add(1, std::memory_order_relaxed);
+				return false;
+			}
+			// The writer will make room, wake it up and stop spinning if that takes longer
+			{
+				std::lock_guard<std::mutex> guard(mtx_);
+				nudged_ = true;
+			}
+			cv_.notify_all();
+			for (std::size_t spin=0; !buffer.queue.try_push(r); ++spin){
+				if (spin < 64) cpu_relax();
+				else std::this_thread::yield();
+			}
+			return true;
+		};
+
+		// Blocks until everything this thread logged before the call is written
+		void flush(){
+			std::unique_lock<std::mutex> guard(mtx_);
+			std::uint64_t wanted = ++flush_requested_;
+			cv_.notify_all();
+			cv_flushed_.wait(guard, [this, wanted](){ return flushed_ >= wanted; });
+		};
+
+		std::uint64_t written() const { return written_.load(std::memory_order_relaxed); };
+		std::uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); };
+
+	private:
+		static constexpr std::size_t record_size = 128;
+
+		struct clock_sample{
+			std::uint64_t ticks;
+			std::chrono::steady_clock::time_point time;
+		};
+
+		// One log() call. The arguments follow each other in `payload`, every one starts
+		// with a type byte: 'i' int64, 'u' uint64, 'd' double, 'b' bool, 'c' char and
+		// 's' string with a length byte after it.
+		struct record{
+			std::uint64_t ticks;
+			const char* format;
+			std::uint32_t thread;
+			std::uint16_t size;
+			char payload[record_size - 8 - sizeof(const char*) - 4 - 2];
+		};
+		static_assert(sizeof(record) == record_size);
+
+		// Owned by the logger and the thread that logs into it, whichever lets go last frees it
+		struct buffer_t{
+			explicit buffer_t(std::size_t capacity, std::uint32_t thread) : queue(capacity), thread(thread){};
+			bounded_spsc_queue<record> queue;
+			std::uint32_t thread;
+			std::atomic<bool> retired{false};  // the thread has exited, nothing more gets pushed
+			std::atomic<bool> orphaned{false}; // the logger is gone
+		};
+
+		// The buffers a thread got from the loggers it used, usually just one or two. The
+		// logger id tells a new logger from an old one at the same address. When the thread
+		// exits its buffers are retired and the writer frees them once they are empty.
+		struct thread_cache{
+			struct entry{
+				std::uint64_t logger_id;
+				std::shared_ptr<buffer_t> buffer;
+			};
+			std::vector<entry> entries;
+
+			~thread_cache(){
+				for (entry& e : entries) e.buffer->retired.store(true, std::memory_order_release);
+			};
+		};
+
+		static std::atomic<std::uint64_t>& next_logger_id(){
+			static std::atomic<std::uint64_t> id{1};
+			return id;
+		};
+
+		// rdtsc where there is one, it costs a fraction of a clock call. The writer maps
+		// ticks to time with two samples of both clocks.
+		static std::uint64_t ticks(){
+#if defined(__x86_64__) || defined(__i386__)
+			return __rdtsc();
+#else
+			return std::uint64_t(std::chrono::steady_clock::now().time_since_epoch().count());
+#endif
+		};
+		static clock_sample sample_clock(){ return clock_sample{ticks(), std::chrono::steady_clock::now()}; };
+
+		buffer_t& local_buffer(){
+			thread_local thread_cache cache;
+			for (thread_cache::entry& e : cache.entries) if (e.logger_id == id_) return *e.buffer;
+			// First record from this thread, forget the buffers of loggers that are gone
+			std::erase_if(cache.entries, [](const thread_cache::entry& e){ return e.buffer->orphaned.load(std::memory_order_acquire); });
+			std::shared_ptr<buffer_t> buffer;
+			{
+				std::lock_guard<std::mutex> guard(mtx_buffers_);
+				buffer = std::make_shared<buffer_t>(options_.buffer_records, next_thread_++);
+				buffers_.push_back(buffer);
+				buffers_changed_.store(true, std::memory_order_release);
+			}
+			cache.entries.push_back(thread_cache::entry{id_, buffer});
+			return *buffer;
+		};
+
+		template <typename T>
+		static void encode(record& r, std::size_t& used, const T& value){
+			constexpr std::size_t room = sizeof(r.payload);
+			auto put = [&](char type, const void* data, std::size_t size){
+				if (used + 1 + size > room) return;
+				r.payload[used++] = type;
+				std::memcpy(r.payload + used, data, size);
+				used += size;
+			};
+			if constexpr (std::is_same_v<T, bool>) put('b', &value, 1);
+			else if constexpr (std::is_same_v<T, char>) put('c', &value, 1);
+			else if constexpr (std::is_integral_v<T> && std::is_signed_v<T>){
+				std::int64_t v = value;
+				put('i', &v, sizeof(v));
+			} else if constexpr (std::is_integral_v<T>){
+				std::uint64_t v = value;
+				put('u', &v, sizeof(v));
+			} else if constexpr (std::is_floating_point_v<T>){
+				double v = value;
+				put('d', &v, sizeof(v));
+			} else {
+				std::string_view text(value);
+				if (used + 2 > room) return;
+				std::size_t length = std::min({text.size(), room - used - 2, std::size_t(255)});
+				r.payload[used++] = 's';
+				r.payload[used++] = char(std::uint8_t(length));
+				std::memcpy(r.payload + used, text.data(), length);
+				used += length;
+			}
+		};
+
+		// Appends the record's format with every "{}" replaced by the next argument
+		void format(std::string& out, const record& r, double seconds) const {
+			char number[32];
+			if (options_.prefix){
+				auto end = std::to_chars(number, number + sizeof(number), seconds, std::chars_format::fixed, 6).ptr;
+				out += '[';
+				out.append(number, end);
+				out += "] (t";
+				out.append(number, std::to_chars(number, number + sizeof(number), r.thread).ptr);
+				out += ") ";
+			}
+			std::size_t at = 0;
+			for (const char* f = r.format; *f; ++f){
+				if (f[0] != '{' || f[1] != '}'){
+					out += *f;
+					continue;
+				}
+				++f;
+				if (at >= r.size) continue; // more placeholders than arguments
+				char type = r.payload[at++];
+				const char* data = r.payload + at;
+				if (type == 's'){
+					std::size_t length = std::uint8_t(data[0]);
+					out.append(data + 1, length);
+					at += 1 + length;
+				} else if (type == 'c'){
+					out += data[0];
+					at += 1;
+				} else if (type == 'b'){
+					out += data[0] ? "true" : "false";
+					at += 1;
+				} else {
+					char* end = number;
+					if (type == 'i'){
+						std::int64_t v;
+						std::memcpy(&v, data, sizeof(v));
+						end = std::to_chars(number, number + sizeof(number), v).ptr;
+					} else if (type == 'u'){
+						std::uint64_t v;
+						std::memcpy(&v, data, sizeof(v));
+						end = std::to_chars(number, number + sizeof(number), v).ptr;
+					} else {
+						double v;
+						std::memcpy(&v, data, sizeof(v));
+						end = std::to_chars(number, number + sizeof(number), v).ptr;
+					}
+					out.append(number, end);
+					at += 8;
+				}
+			}
+			out += '\n';
+		};
+
+		// Takes everything out of every buffer, returns false if there was nothing. The list
+		// of buffers is only looked at (under the lock, once) when a thread registered one or
+		// a retired one can go, otherwise the writer works from its own copy.
+		bool drain(std::vector<record>& batch, std::string& text){
+			batch.clear();
+			if (drop_retired_ || buffers_changed_.exchange(false, std::memory_order_acquire)){
+				std::lock_guard<std::mutex> guard(mtx_buffers_);
+				std::erase_if(buffers_, [](const std::shared_ptr<buffer_t>& b){
+					return b->retired.load(std::memory_order_acquire) && b->queue.empty();
+				});
+				active_.clear();
+				for (auto& buffer : buffers_) active_.push_back(buffer.get());
+				drop_retired_ = false;
+			}
+			for (buffer_t* buffer : active_){
+				// Read before popping, a retired buffer gets no more records so it is empty after
+				bool retired = buffer->retired.load(std::memory_order_acquire);
+				record r;
+				while (buffer->queue.try_pop(r)) batch.push_back(r);
+				if (retired) drop_retired_ = true;
+			}
+			if (batch.empty()) return false;
+
+			std::stable_sort(batch.begin(), batch.end(), [](const record& a, const record& b){ return a.ticks < b.ticks; });
+			clock_sample now = sample_clock();
+			double ns_per_tick = now.ticks > start_.ticks ? double(std::chrono::duration_cast<std::chrono::nanoseconds>(now.time - start_.time).count()) / double(now.ticks - start_.ticks) : 1.0;
+			text.clear();
+			for (const record& r : batch){
+				double seconds = r.ticks > start_.ticks ? double(r.ticks - start_.ticks) * ns_per_tick / 1e9 : 0.0;
+				format(text, r, seconds);
+			}
+			std::uint64_t lost = dropped_.load(std::memory_order_relaxed);
+			if (lost != reported_drops_){
+				text += "[" + std::to_string(lost - reported_drops_) + " log records dropped]\n";
+				reported_drops_ = lost;
+			}
+			out_.write(text.data(), std::streamsize(text.size()));
+			out_.flush();
+			written_.fetch_add(batch.size(), std::memory_order_relaxed);
+			return true;
+		};
+
+		void run(){
+			std::vector<record> batch;
+			std::string text;
+			std::chrono::microseconds sleep = options_.poll_interval;
+			std::unique_lock<std::mutex> guard(mtx_);
+			while (true){
+				std::uint64_t requested = flush_requested_;
+				bool stopping = stop_;
+				nudged_ = false;
+				guard.unlock();
+				bool busy = drain(batch, text);
+				while (busy && drain(batch, text)){}
+				guard.lock();
+				if (requested > flushed_){
+					flushed_ = requested;
+					cv_flushed_.notify_all();
+				}
+				if (stopping) return;
+				sleep = busy ? options_.poll_interval : std::min(sleep * 2, options_.poll_interval * 64);
+				cv_.wait_for(guard, sleep, [this, requested](){ return stop_ || nudged_ || flush_requested_ != requested; });
+			}
+		};
+
+		std::ostream& out_;
+		const logger_options options_;
+		const std::uint64_t id_;
+		const clock_sample start_;
+
+		std::mutex mtx_buffers_;
+		std::vector<std::shared_ptr<buffer_t>> buffers_;
+		std::uint32_t next_thread_ = 0;
+		std::atomic<bool> buffers_changed_{false};
+		std::vector<buffer_t*> active_; // writer thread only, a copy of buffers_
+		bool drop_retired_ = false;     // writer thread only
+
+		std::atomic<std::uint64_t> written_{0};
+		std::atomic<std::uint64_t> dropped_{0};
+		std::uint64_t reported_drops_ = 0; // writer thread only
+
+		std::mutex mtx_;
+		std::condition_variable cv_;
+		std::condition_variable cv_flushed_;
+		std::uint64_t flush_requested_ = 0;
+		std::uint64_t flushed_ = 0;
+		bool nudged_ = false; // a producer waits for room in its buffer
+		bool stop_ = false;
+		std::thread writer_;
+};
@@ -6,6 +6,14 @@
 #include <cstdlib>
 #include <ctime>
 #include <chrono>
+#include <atomic>
+#include <random>
+#include <span>
+#include <array>
+#include <stdexcept>
+#include <iomanip>
+
+#include "lock_table.hpp"
 
 
 class BankAccount
@@ -43,42 +51,29 @@ public:
 		// Prevent withdrawing negative amount.
 		if (amount <= 0)
 			throw std::runtime_error("Withdraw amount must be greater than 0.");
+		// Checked under the lock, otherwise two withdrawals can both pass the check
+		std::lock_guard<std::mutex> lock(mtx_);
 		if (balance_ < amount)
 			throw std::runtime_error("Insufficient balance.");
-		std::lock_guard<std::mutex> lock(mtx_);
 
 		balance_ -= amount;
 		return balance_;
 	}
 
+	// Both accounts are locked for the whole transfer, nobody sees the money in neither or
+	// both of them. std::scoped_lock takes the two mutexes without deadlocking when another
+	// thread transfers the other way at the same time.
 	bool transferAmount(BankAccount &to, int amount)
 	{
-		bool withdrawSuccess = false;
-		bool depositSuccess = false;
-
-		// Withdraw from this account
-		try
-		{
-			withdraw(amount);
-			withdrawSuccess = true;
-		}
-		catch (std::runtime_error &e)
-		{
+		if (&to == this || amount <= 0)
+			return false;
+		std::scoped_lock lock(mtx_, to.mtx_);
+		if (balance_ < amount)
 			return false;
-		}
-
-		// Deposit to the other account
-		try
-		{
-			to.deposit(amount);
-			depositSuccess = true;
-		}
-		catch (std::runtime_error &e)
-		{
-			deposit(amount);
-		}
 
-		return withdrawSuccess && depositSuccess;
+		balance_ -= amount;
+		to.balance_ += amount;
+		return true;
 	}
 
 	long long int getBalance()
@@ -94,6 +89,129 @@ public:
 	}
 };
 
+// One part of a transaction: `amount` goes into `account`, a negative amount takes it out
+struct Leg
+{
+	std::size_t account;
+	long long int amount;
+};
+
+// Many accounts as one column of balances, guarded by a striped lock table instead of a mutex
+// per account. transact() moves money between any number of accounts at once.
+// With one stripe this is a bank with a global lock, with as many stripes as accounts every
+// account has its own mutex.
+class Bank
+{
+private:
+	std::vector<long long int> balances_;
+	lock_table locks_;
+
+public:
+	Bank(std::size_t accounts, long long int startingBalance, std::size_t stripes)
+		: balances_(accounts, startingBalance), locks_(stripes)
+	{
+	}
+
+	// All legs happen or none: the amounts must add up to 0 (money only moves) and no account
+	// may end up below 0, otherwise nothing changes and it returns false. An account can
+	// appear in several legs.
+	bool transact(std::span<const Leg> legs)
+	{
+		long long int sum = 0;
+		for (const Leg &leg : legs)
+		{
+			if (leg.account >= balances_.size())
+				throw std::out_of_range("Account " + std::to_string(leg.account) + " doesn't exist.");
+			sum += leg.amount;
+		}
+		if (sum != 0)
+			throw std::invalid_argument("A transaction can't create or destroy money.");
+
+		std::array<std::size_t, 8> few;
+		std::vector<std::size_t> many;
+		std::span<std::size_t> accounts(few.data(), legs.size());
+		if (legs.size() > few.size())
+		{
+			many.resize(legs.size());
+			accounts = many;
+		}
+		for (std::size_t i = 0; i < legs.size(); i++)
+			accounts[i] = legs[i].account;
+		auto guard = locks_.lock(accounts);
+
+		// Apply, then take it back if somebody went below 0
+		for (const Leg &leg : legs)
+			balances_[leg.account] += leg.amount;
+		for (const Leg &leg : legs)
+		{
+			if (balances_[leg.account] < 0)
+			{
+				for (const Leg &undo : legs)
+					balances_[undo.account] -= undo.amount;
+				return false;
+			}
+		}
+		return true;
+	}
+
+	long long int balance(std::size_t account)
+	{
+		auto guard = locks_.lock({account});
+		return balances_.at(account);
+	}
+
+	// Every account at one moment, all the stripes are held while adding up
+	long long int total()
+	{
+		auto guard = locks_.lock_all();
+		long long int sum = 0;
+		for (long long int balance : balances_)
+			sum += balance;
+		return sum;
+	}
+
+	std::size_t size() const { return balances_.size(); }
+	std::size_t stripes() const { return locks_.size(); }
+};
+
+// Transactions per second of `threads` threads each paying two random accounts from a third,
+// and whether the money adds up afterwards. Few accounts is contention on the accounts
+// themselves, many accounts is contention only on the locks.
+void timeTransactions(std::size_t accounts, std::size_t stripes, std::size_t threads, std::size_t transactionsPerThread)
+{
+	using namespace std;
+	Bank bank(accounts, 1000, stripes);
+	long long int before = bank.total();
+	atomic<size_t> committed = 0;
+	vector<thread> workers;
+	auto start_time = chrono::high_resolution_clock::now();
+	for (size_t t = 0; t < threads; t++)
+	{
+		workers.emplace_back([&bank, &committed, accounts, transactionsPerThread, t]() {
+			mt19937_64 rng(t + 1);
+			uniform_int_distribution<size_t> account(0, accounts - 1);
+			uniform_int_distribution<long long int> amount(1, 100);
+			size_t done = 0;
+			for (size_t i = 0; i < transactionsPerThread; i++)
+			{
+				long long int first = amount(rng), second = amount(rng);
+				Leg legs[] = {{account(rng), -(first + second)}, {account(rng), first}, {account(rng), second}};
+				done += bank.transact(legs);
+			}
+			committed += done;
+		});
+	}
+	for (thread &worker : workers)
+		worker.join();
+	chrono::duration<double> duration = chrono::high_resolution_clock::now() - start_time;
+	size_t transactions = threads * transactionsPerThread;
+	long long int after = bank.total();
+
+	cout << setw(9) << accounts << setw(9) << bank.stripes() << setw(9) << threads << setw(14) << fixed << setprecision(0) << double(transactions) / duration.count()
+		 << setw(12) << setprecision(1) << 100.0 * double(committed) / double(transactions) << "%" << "  " << (before == after ? "money adds up" : "MONEY LOST")
+		 << defaultfloat << setprecision(6) << endl;
+}
+
 void doRandomOperations(std::vector<BankAccount> &bankAccounts, long long int randomOperations, bool logOperations = false)
 {
 	std::vector<std::string> operations = {"deposit", "withdraw", "transfer"};
@@ -181,5 +299,18 @@ int main()
 	std::cout << "Ending balance of the two accounts after " << randomOperations << " random transactions from 4 threads:" << std::endl;
 	std::cout << "\t" << bankAccounts.at(0).getName() << " -> " << bankAccounts.at(0).getBalance() << std::endl;
 	std::cout << "\t" << bankAccounts.at(1).getName() << " -> " << bankAccounts.at(1).getBalance() << std::endl;
+
+	// 3-account transactions with a global lock, 1024 stripes and as many stripes as accounts,
+	// on 16 hot accounts and on a million. More stripes than that only cost memory and cache.
+	std::size_t threads = std::max(4u, std::thread::hardware_concurrency());
+	std::cout << std::endl << std::setw(9) << "accounts" << std::setw(9) << "stripes" << std::setw(9) << "threads" << std::setw(14) << "tx/s" << std::setw(13) << "committed" << std::endl;
+	for (std::size_t accounts : {16, 1000000})
+	{
+		for (std::size_t stripes : {std::size_t(1), std::size_t(1024), accounts})
+		{
+			timeTransactions(accounts, stripes, 1, 1000000);
+			timeTransactions(accounts, stripes, threads, 1000000 / threads);
+		}
+	}
 	return 0;
 }
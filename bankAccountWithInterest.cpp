@@ -8,8 +8,16 @@
 #include <atomic>
 #include <iomanip>
 
+#include "async_logger.hpp"
+
 // Bank account with interest after every 100 transactions, using atomic operations
 
+// The account threads only put records into their own buffer, the printing happens on the
+// logger's thread. Printing straight to std::cout made every transaction wait for the stream.
+async_logger logger;
+// Failed operations still go to stderr
+async_logger errorLogger(std::cerr);
+
 
 // Found how to do atomic multiply from https://www.modernescpp.com/index.php/atomics/
 // Any calculation can be done this way
@@ -32,14 +40,14 @@ private:
 	{
 		numberOfTransactions_++;
 		auto TransactionCount = numberOfTransactions_.load();
-		if(logActions) std::cout << "TransactionCount: " << TransactionCount << std::endl;
+		if(logActions) logger.log("TransactionCount: {}", TransactionCount);
 		if (TransactionCount%100==0 && numberOfTransactions_!=0){
 			auto oldBalance = balance_.load();
 			auto interest = oldBalance * (0.05/100); // 0.05% interest
 			auto newBalance = oldBalance + interest;
 			while (!balance_.compare_exchange_strong(oldBalance, newBalance));
 			if (logActions){
-				std::cout << "AddInterest\t" << interest << "\t"<< name_ << ": " << oldBalance<<"->"<<newBalance << "\t After "<< TransactionCount << " transactions" << std::endl;
+				logger.log("AddInterest\t{}\t{}: {}->{}\t After {} transactions", interest, name_, oldBalance, newBalance, TransactionCount);
 			}
 		}
 		return balance_.load();
@@ -73,7 +81,7 @@ public:
 		// the state when we have read it. When it matches the state we replace the old balance with the new balance.
 		while (!balance_.compare_exchange_strong(oldBalance, newBalance));
 		if (logActions){
-			std::cout << "Deposit \t" << amount << "\t"<< name_ << ": " << oldBalance<<"->"<<newBalance << std::endl;
+			logger.log("Deposit \t{}\t{}: {}->{}", amount, name_, oldBalance, newBalance);
 		}
 		updateNumberOfTransactions();
 
@@ -95,7 +103,7 @@ public:
 		// the state when we have read it. When it matches the state we replace the old balance with the new balance.
 		while (!balance_.compare_exchange_strong(oldBalance, newBalance));
 		if (logActions){
-			std::cout << "Withdraw \t" << amount << "\t"<< name_ << ": " << oldBalance<<"->"<<newBalance << std::endl;
+			logger.log("Withdraw \t{}\t{}: {}->{}", amount, name_, oldBalance, newBalance);
 		}
 		updateNumberOfTransactions();
 
@@ -135,7 +143,7 @@ public:
 		}
 		if (withdrawSuccess && depositSuccess)
 			if(logActions) {
-				std::cout << "Transfer \t" << amount << "\t" << "From " << name_ << ": " << fromOldBalance<<"->"<<balance_.load() <<"\t To "<<to.getName()<<": "<<toOldBalance<<"->"<<to.getBalance() << std::endl;
+				logger.log("Transfer \t{}\tFrom {}: {}->{}\t To {}: {}->{}", amount, name_, fromOldBalance, balance_.load(), to.getName(), toOldBalance, to.getBalance());
 			}
 			updateNumberOfTransactions();
 			return true;
@@ -190,7 +198,7 @@ void doRandomOperations(std::vector<BankAccount> &bankAccounts, long long int ra
 		{
 			if (logActions)
 			{
-				std::cerr << e.what() << std::endl;
+				errorLogger.log("{}", e.what());
 			}
 		}
 	}
@@ -231,6 +239,8 @@ int main()
 	t2.join();
 	t3.join();
 	t4.join();
+	logger.flush();
+	errorLogger.flush();
 
 	// Print the balance of the two accounts.
 	std::cout << "Ending balance of the two accounts after " << randomOperations << " random transactions from 4 threads:" << std::endl;
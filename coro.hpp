@@ -0,0 +1,326 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "threadpool.hpp"
+
+
+// C++20 coroutines on top of thread_pool.
+//
+//     coro::task<int> work(thread_pool& pool, timer_queue& timers){
+//         co_await pool.schedule();           // continue on a pool worker
+//         co_await timers.sleep_for(10ms);    // no thread waits during the sleep
+//         co_return 42;
+//     }
+//     int answer = coro::sync_wait(work(pool, timers));
+//
+// A task doesn't start until it is awaited (or passed to sync_wait / when_all / when_any)
+// and the awaiting coroutine continues on whatever thread the task finished on.
+namespace coro{
+
+	template <typename T = void>
+	class task;
+
+	namespace detail{
+		struct promise_base{
+			std::coroutine_handle<> continuation = std::noop_coroutine();
+			std::exception_ptr error;
+
+			std::suspend_always initial_suspend() noexcept { return {}; };
+			// Jumps straight into the awaiting coroutine (symmetric transfer), so long chains
+			// of tasks don't grow the stack
+			struct final_awaiter{
+				bool await_ready() noexcept { return false; };
+				template <typename P>
+				std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept { return h.promise().continuation; };
+				void await_resume() noexcept {};
+			};
+			final_awaiter final_suspend() noexcept { return {}; };
+			void unhandled_exception(){ error = std::current_exception(); };
+		};
+
+		template <typename T>
+		struct promise : promise_base{
+			std::optional<T> value;
+			task<T> get_return_object();
+			template <typename U>
+			void return_value(U&& v){ value.emplace(std::forward<U>(v)); };
+			T result(){
+				if (error) std::rethrow_exception(error);
+				return std::move(*value);
+			};
+		};
+		template <>
+		struct promise<void> : promise_base{
+			task<void> get_return_object();
+			void return_void(){};
+			void result(){
+				if (error) std::rethrow_exception(error);
+			};
+		};
+
+		// Starts right away and frees itself at the end, used to drive tasks from plain code
+		struct detached{
+			struct promise_type{
+				detached get_return_object(){ return {}; };
+				std::suspend_never initial_suspend() noexcept { return {}; };
+				std::suspend_never final_suspend() noexcept { return {}; };
+				void return_void(){};
+				void unhandled_exception(){ std::terminate(); };
+			};
+		};
+
+		// void can't be stored, results of task<void> are kept as this
+		struct nothing{};
+		template <typename T>
+		using stored_t = std::conditional_t<std::is_void_v<T>, nothing, T>;
+	}
+
+	template <typename T>
+	class task{
+		public:
+			using promise_type = detail::promise<T>;
+			using handle_t = std::coroutine_handle<promise_type>;
+
+			task(const task&) = delete;
+			task& operator = (const task&) = delete;
+			task(task&& other) noexcept : h_(std::exchange(other.h_, {})){};
+			task& operator = (task&& other) noexcept {
+				if (this != &other){
+					if (h_) h_.destroy();
+					h_ = std::exchange(other.h_, {});
+				}
+				return *this;
+			};
+			~task(){ if (h_) h_.destroy(); };
+
+			auto operator co_await() noexcept {
+				struct awaiter{
+					handle_t h;
+					bool await_ready() const noexcept { return !h || h.done(); };
+					std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+						h.promise().continuation = awaiting;
+						return h;
+					};
+					T await_resume(){ return h.promise().result(); };
+				};
+				return awaiter{h_};
+			};
+
+		private:
+			friend struct detail::promise<T>;
+			explicit task(handle_t h) : h_(h){};
+			handle_t h_;
+	};
+
+	namespace detail{
+		template <typename T>
+		task<T> promise<T>::get_return_object(){ return task<T>(std::coroutine_handle<promise<T>>::from_promise(*this)); };
+		inline task<void> promise<void>::get_return_object(){ return task<void>(std::coroutine_handle<promise<void>>::from_promise(*this)); };
+
+		template <typename T>
+		struct sync_state{
+			std::mutex mtx;
+			std::condition_variable cv;
+			bool done = false;
+			std::optional<stored_t<T>> value;
+			std::exception_ptr error;
+		};
+
+		template <typename T>
+		detached sync_wait_runner(task<T> t, sync_state<T>* state){
+			try {
+				if constexpr (std::is_void_v<T>){
+					co_await t;
+					state->value.emplace();
+				} else state->value.emplace(co_await t);
+			} catch (...){
+				state->error = std::current_exception();
+			}
+			// Notify while holding the lock, sync_wait may return and free `state` right after
+			std::lock_guard<std::mutex> guard(state->mtx);
+			state->done = true;
+			state->cv.notify_all();
+		};
+	}
+
+	// Blocks the calling (non-coroutine) thread until the task is done and returns its result
+	template <typename T>
+	T sync_wait(task<T> t){
+		detail::sync_state<T> state;
+		detail::sync_wait_runner(std::move(t), &state);
+		std::unique_lock<std::mutex> guard(state.mtx);
+		state.cv.wait(guard, [&state](){ return state.done; });
+		if (state.error) std::rethrow_exception(state.error);
+		if constexpr (!std::is_void_v<T>) return std::move(*state.value);
+	};
+
+
+	namespace detail{
+		template <typename T>
+		struct all_state{
+			// One count per task plus one for the awaiting coroutine itself, so it can't be
+			// resumed before it has actually suspended
+			std::atomic<std::size_t> remaining;
+			std::coroutine_handle<> continuation;
+			std::vector<std::optional<stored_t<T>>> results;
+			std::exception_ptr error;
+			std::mutex mtx_error;
+
+			void arrive(){ if (remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) continuation.resume(); };
+		};
+
+		template <typename T>
+		detached when_all_runner(task<T> t, all_state<T>* state, std::size_t index){
+			try {
+				if constexpr (std::is_void_v<T>){
+					co_await t;
+					state->results[index].emplace();
+				} else state->results[index].emplace(co_await t);
+			} catch (...){
+				std::lock_guard<std::mutex> guard(state->mtx_error);
+				if (!state->error) state->error = std::current_exception();
+			}
+			state->arrive();
+		};
+
+		template <typename T>
+		struct all_awaiter{
+			std::vector<task<T>>& tasks;
+			all_state<T>& state;
+			bool await_ready() const { return tasks.empty(); };
+			bool await_suspend(std::coroutine_handle<> h){
+				state.continuation = h;
+				for (std::size_t i=0; i<tasks.size(); ++i) when_all_runner(std::move(tasks[i]), &state, i);
+				// false resumes us right away when every task already finished inline
+				return state.remaining.fetch_sub(1, std::memory_order_acq_rel) != 1;
+			};
+			void await_resume() const {};
+		};
+	}
+
+	// Runs all tasks at the same time and completes when the last one does. Results come
+	// back in the order of `tasks`, the first exception thrown by any of them is rethrown.
+	template <typename T>
+	auto when_all(std::vector<task<T>> tasks) -> task<std::conditional_t<std::is_void_v<T>, void, std::vector<T>>>{
+		detail::all_state<T> state;
+		state.remaining.store(tasks.size() + 1);
+		state.results.resize(tasks.size());
+		co_await detail::all_awaiter<T>{tasks, state};
+		if (state.error) std::rethrow_exception(state.error);
+		if constexpr (!std::is_void_v<T>){
+			std::vector<T> results;
+			results.reserve(state.results.size());
+			for (auto& r : state.results) results.push_back(std::move(*r));
+			co_return results;
+		}
+	};
+
+
+	namespace detail{
+		template <typename T>
+		struct any_state{
+			std::atomic<bool> decided{false};
+			std::coroutine_handle<> continuation;
+			std::size_t index = 0;
+			std::optional<stored_t<T>> value;
+			std::exception_ptr error;
+		};
+
+		template <typename T>
+		detached when_any_runner(task<T> t, std::shared_ptr<any_state<T>> state, std::size_t index){
+			std::optional<stored_t<T>> value;
+			std::exception_ptr error;
+			try {
+				if constexpr (std::is_void_v<T>){
+					co_await t;
+					value.emplace();
+				} else value.emplace(co_await t);
+			} catch (...){
+				error = std::current_exception();
+			}
+			// Only the first task to finish gets to report, the others are ignored
+			if (state->decided.exchange(true, std::memory_order_acq_rel)) co_return;
+			state->index = index;
+			state->value = std::move(value);
+			state->error = error;
+			state->continuation.resume();
+		};
+	}
+
+	// Runs all tasks at the same time and completes when the first one does, giving back its
+	// index (and value). The other tasks keep running to the end, their results are dropped.
+	template <typename T>
+	auto when_any(std::vector<task<T>> tasks) -> task<std::conditional_t<std::is_void_v<T>, std::size_t, std::pair<std::size_t, T>>>{
+		if (tasks.empty()) throw std::invalid_argument("when_any needs at least one task.");
+		auto state = std::make_shared<detail::any_state<T>>();
+		struct awaiter{
+			std::vector<task<T>>& tasks;
+			std::shared_ptr<detail::any_state<T>>& state;
+			bool await_ready() const { return false; };
+			void await_suspend(std::coroutine_handle<> h){
+				state->continuation = h;
+				// `this` may be gone once the first runner resumes us, so work on copies
+				std::vector<task<T>> starting = std::move(tasks);
+				std::shared_ptr<detail::any_state<T>> shared = state;
+				for (std::size_t i=0; i<starting.size(); ++i) detail::when_any_runner(std::move(starting[i]), shared, i);
+			};
+			void await_resume() const {};
+		};
+		co_await awaiter{tasks, state};
+		if (state->error) std::rethrow_exception(state->error);
+		if constexpr (std::is_void_v<T>) co_return state->index;
+		else co_return std::pair<std::size_t, T>(state->index, std::move(*state->value));
+	};
+
+
+	// Manual-reset event coroutines can wait on. set() resumes every waiter on the thread
+	// that calls it, later waiters don't suspend at all.
+	class event{
+		public:
+			void set(){
+				std::vector<std::coroutine_handle<>> waiting;
+				{
+					std::lock_guard<std::mutex> guard(mtx_);
+					is_set_ = true;
+					waiting.swap(waiters_);
+				}
+				for (auto h : waiting) h.resume();
+			};
+			bool is_set() const {
+				std::lock_guard<std::mutex> guard(mtx_);
+				return is_set_;
+			};
+
+			auto operator co_await() noexcept {
+				struct awaiter{
+					event& e;
+					bool await_ready() const { return e.is_set(); };
+					bool await_suspend(std::coroutine_handle<> h){
+						std::lock_guard<std::mutex> guard(e.mtx_);
+						if (e.is_set_) return false; // set() ran since await_ready
+						e.waiters_.push_back(h);
+						return true;
+					};
+					void await_resume() const {};
+				};
+				return awaiter{*this};
+			};
+
+		private:
+			mutable std::mutex mtx_;
+			bool is_set_ = false;
+			std::vector<std::coroutine_handle<>> waiters_;
+	};
+}
@@ -2,11 +2,18 @@
 #include <thread>
 #include <vector>
 
+#include "topology.hpp"
+#include "async_logger.hpp"
+
+// The workers log as fast as they can, more than any terminal shows. Dropping what doesn't
+// fit keeps them running at full speed instead of taking turns on std::cout.
+async_logger logger(std::cout, logger_options{.when_full = log_overflow::drop});
+
 void worker(int thread_id)
 {
 	while (true)
 	{
-		std::cout << "Thread " << thread_id << " is working" << std::endl;
+		logger.log("Thread {} is working", thread_id);
 	}
 }
 
@@ -18,13 +25,31 @@ int main()
 	std::cout << "This machine supports concurrency with " << num_cores
 			  << " cores available" << std::endl;
 
+	// Print what the cores actually are
+	cpu_topology topology = cpu_topology::discover();
+	std::cout << "Packages: " << topology.package_count()
+			  << ", physical cores: " << topology.physical_core_count()
+			  << ", logical CPUs: " << topology.logical_cpu_count()
+			  << ", NUMA nodes: " << topology.numa_nodes().size() << std::endl;
+	for (const cpu_info &cpu : topology.cpus())
+	{
+		std::cout << "\tCPU " << cpu.id << ": package " << cpu.package_id << ", core " << cpu.core_id
+				  << ", node " << cpu.numa_node << ", SMT siblings " << cpu.smt_siblings.size()
+				  << ", shares last level cache with " << cpu.last_cache_siblings.size() << " CPUs" << std::endl;
+	}
+
 	// Create a vector to store the threads.
 	std::vector<std::thread> threads;
 
-	// Create a thread for each core.
+	// Create a thread for each core, pinned one per CPU.
+	std::vector<unsigned> order = topology.placement_order(placement::scatter);
 	for (int i = 1; i <= num_cores; i++)
 	{
-		threads.push_back(std::thread(worker, i));
+		unsigned cpu = order.empty() ? 0 : order[(i - 1) % order.size()];
+		threads.push_back(std::thread([i, cpu, pin = !order.empty()]()
+									  {
+			if (pin) pin_current_thread({cpu});
+			worker(i); }));
 	}
 
 	// Wait for all threads to finish.
@@ -0,0 +1,212 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+
+// How long one service takes, drawn again for every item. Implicitly made from a number,
+// which is a fixed time, so places that took a constant keep working.
+//
+//     service_distribution scan = 1.0;
+//     auto security = service_distribution::lognormal(10.0, 0.5);
+//     double minutes = security(rng);
+//     auto same = service_distribution::parse("lognormal 10 0.5");
+class service_distribution{
+	public:
+		service_distribution(double fixed_time) : kind_(kind::fixed), mean_(fixed_time){
+			if (fixed_time <= 0) throw std::invalid_argument("A service time must be positive.");
+		};
+
+		static service_distribution fixed(double time){ return service_distribution(time); };
+		static service_distribution exponential(double mean){
+			service_distribution d(mean);
+			d.kind_ = kind::exponential;
+			return d;
+		};
+		// `sigma` is the standard deviation of the underlying normal, mu is picked so the mean is `mean`
+		static service_distribution lognormal(double mean, double sigma){
+			if (sigma < 0) throw std::invalid_argument("Sigma can't be negative.");
+			service_distribution d(mean);
+			d.kind_ = kind::lognormal;
+			d.sigma_ = sigma;
+			d.mu_ = std::log(mean) - sigma * sigma / 2;
+			return d;
+		};
+		// Draws one of the measured `samples` (a bootstrap of what was observed)
+		static service_distribution empirical(std::vector<double> samples){
+			if (samples.empty()) throw std::invalid_argument("An empirical distribution needs samples.");
+			double total = 0;
+			for (double s : samples){
+				if (s <= 0) throw std::invalid_argument("A service time must be positive.");
+				total += s;
+			}
+			service_distribution d(total / double(samples.size()));
+			d.kind_ = kind::empirical;
+			d.samples_ = std::move(samples);
+			return d;
+		};
+		// The same as text: a number (fixed), "fixed m", "exponential mean",
+		// "lognormal mean sigma" or "empirical s1 s2 ..."
+		static service_distribution parse(std::string_view text){
+			std::istringstream in{std::string(text)};
+			std::string kind;
+			in >> kind;
+			std::vector<double> values;
+			for (double v; in >> v;) values.push_back(v);
+			bool trailing = !in.eof();
+			auto bad = [text](){ return std::invalid_argument("Can't read the service time \"" + std::string(text) + "\"."); };
+			if (trailing || kind.empty()) throw bad();
+			if (kind == "fixed" && values.size() == 1) return fixed(values[0]);
+			if (kind == "exponential" && values.size() == 1) return exponential(values[0]);
+			if (kind == "lognormal" && values.size() == 2) return lognormal(values[0], values[1]);
+			if (kind == "empirical") return empirical(std::move(values));
+			std::size_t used = 0;
+			double time = 0;
+			try { time = std::stod(kind, &used); } catch (const std::exception&) { throw bad(); }
+			if (used != kind.size() || !values.empty()) throw bad();
+			return service_distribution(time);
+		};
+
+		template <typename Rng>
+		double operator()(Rng& rng) const {
+			switch (kind_){
+				case kind::exponential: return std::exponential_distribution<double>(1.0 / mean_)(rng);
+				case kind::lognormal: return std::lognormal_distribution<double>(mu_, sigma_)(rng);
+				case kind::empirical: return samples_[std::uniform_int_distribution<std::size_t>(0, samples_.size() - 1)(rng)];
+				default: return mean_;
+			}
+		};
+
+		double mean() const { return mean_; };
+		bool is_fixed() const { return kind_ == kind::fixed; };
+		// Squared coefficient of variation, variance / mean^2: 0 fixed, 1 exponential
+		double scv() const {
+			switch (kind_){
+				case kind::exponential: return 1;
+				case kind::lognormal: return std::exp(sigma_ * sigma_) - 1;
+				case kind::empirical: {
+					double squares = 0;
+					for (double s : samples_) squares += (s - mean_) * (s - mean_);
+					return squares / double(samples_.size()) / (mean_ * mean_);
+				}
+				default: return 0;
+			}
+		};
+
+	private:
+		enum class kind{ fixed, exponential, lognormal, empirical };
+
+		kind kind_;
+		double mean_;
+		double mu_ = 0;
+		double sigma_ = 0;
+		std::vector<double> samples_;
+};
+
+
+// When items show up. next() gives the arrival time of item `index` from the one before it.
+//   all_at_once  everybody at time 0
+//   poisson      independent arrivals, `rate` per time unit on average
+//   bursty       groups of `group_size` arriving together, `group_rate` groups per time unit
+//   waves        `per_wave` arrive together every `every` time units, like flights landing
+//   recorded     at the given times, a replayed trace
+class arrival_process{
+	public:
+		static arrival_process all_at_once(){ return arrival_process(kind::all_at_once); };
+		static arrival_process poisson(double rate){
+			if (rate <= 0) throw std::invalid_argument("The arrival rate must be positive.");
+			arrival_process a(kind::poisson);
+			a.rate_ = rate;
+			return a;
+		};
+		static arrival_process bursty(double group_rate, std::size_t group_size){
+			if (group_rate <= 0 || !group_size) throw std::invalid_argument("Bursts need a positive rate and size.");
+			arrival_process a(kind::bursty);
+			a.rate_ = group_rate;
+			a.size_ = group_size;
+			return a;
+		};
+		static arrival_process waves(std::size_t per_wave, double every){
+			if (!per_wave || every <= 0) throw std::invalid_argument("Waves need a positive size and interval.");
+			arrival_process a(kind::waves);
+			a.size_ = per_wave;
+			a.every_ = every;
+			return a;
+		};
+		// `times` in order, item i arrives at times[i]. There can't be more items than times.
+		static arrival_process recorded(std::vector<double> times){
+			if (times.empty()) throw std::invalid_argument("A recorded arrival process needs times.");
+			if (!std::is_sorted(times.begin(), times.end())) throw std::invalid_argument("Recorded arrival times must be in order.");
+			arrival_process a(kind::recorded);
+			a.times_ = std::make_shared<const std::vector<double>>(std::move(times));
+			return a;
+		};
+
+		template <typename Rng>
+		double next(std::size_t index, double previous, Rng& rng) const {
+			switch (kind_){
+				case kind::poisson: return previous + std::exponential_distribution<double>(rate_)(rng);
+				case kind::bursty: return index % size_ ? previous : previous + std::exponential_distribution<double>(rate_)(rng);
+				case kind::waves: return double(index / size_) * every_;
+				case kind::recorded:
+					if (index >= times_->size()) throw std::out_of_range("The recorded arrivals ran out.");
+					return (*times_)[index];
+				default: return 0;
+			}
+		};
+
+		// Everything arrives at 0, nothing to draw
+		bool simultaneous() const { return kind_ == kind::all_at_once; };
+		// Squared coefficient of variation of the time between arrivals. A batch counts as
+		// gaps of 0 and one long gap, which is how queueing formulas see it.
+		double scv() const {
+			switch (kind_){
+				case kind::poisson: return 1;
+				case kind::bursty: return 2 * double(size_) - 1;
+				case kind::waves: return double(size_) - 1;
+				case kind::recorded: {
+					std::size_t n = times_->size();
+					if (n < 3) return 0;
+					double mean = (times_->back() - times_->front()) / double(n - 1);
+					if (mean <= 0) return 0;
+					double squares = 0;
+					for (std::size_t i=1; i<n; ++i){
+						double gap = (*times_)[i] - (*times_)[i - 1];
+						squares += (gap - mean) * (gap - mean);
+					}
+					return squares / double(n - 1) / (mean * mean);
+				}
+				default: return 0;
+			}
+		};
+		// Items per time unit in the long run, infinite for all_at_once
+		double rate() const {
+			switch (kind_){
+				case kind::poisson: return rate_;
+				case kind::bursty: return rate_ * double(size_);
+				case kind::waves: return double(size_) / every_;
+				case kind::recorded:
+					return times_->back() > times_->front() ? double(times_->size() - 1) / (times_->back() - times_->front()) : INFINITY;
+				default: return INFINITY;
+			}
+		};
+
+	private:
+		enum class kind{ all_at_once, poisson, bursty, waves, recorded };
+		explicit arrival_process(kind k) : kind_(k){};
+
+		kind kind_;
+		double rate_ = 0;
+		std::size_t size_ = 1;
+		double every_ = 0;
+		std::shared_ptr<const std::vector<double>> times_; // shared, copies are cheap
+};
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <condition_variable>
+
+
+// Lets threads sleep until "something changed" without the notifier paying for a
+// lock or a syscall when nobody sleeps.
+// source: folly/experimental/EventCount.h
+//
+// Waiter:                                   Notifier:
+//   auto key = ec.prepare_wait();             publish the work
+//   if (work is available) ec.cancel_wait();  ec.notify_one();
+//   else ec.wait(key);
+//
+// prepare_wait registers the thread as a waiter before it checks the condition one
+// last time, so a notifier either sees the waiter or the waiter sees the work.
+class event_count{
+	public:
+		using key_t = std::uint32_t;
+
+		event_count() = default;
+		event_count(const event_count&) = delete;
+		event_count& operator = (const event_count&) = delete;
+
+		key_t prepare_wait(){
+			std::uint64_t prev = state_.fetch_add(waiter_inc, std::memory_order_seq_cst);
+			return key_t(prev >> epoch_shift);
+		};
+		void cancel_wait(){
+			state_.fetch_sub(waiter_inc, std::memory_order_seq_cst);
+		};
+		void wait(key_t key){
+			{
+				std::unique_lock<std::mutex> guard(mtx_);
+				cv_.wait(guard, [this, key](){ return key_t(state_.load(std::memory_order_seq_cst) >> epoch_shift) != key; });
+			}
+			state_.fetch_sub(waiter_inc, std::memory_order_seq_cst);
+		};
+
+		// Like wait but gives up after `timeout`. Returns false when it timed out without a notify.
+		template <typename Rep, typename Period>
+		bool wait_for(key_t key, std::chrono::duration<Rep, Period> timeout){
+			bool notified;
+			{
+				std::unique_lock<std::mutex> guard(mtx_);
+				notified = cv_.wait_for(guard, timeout, [this, key](){ return key_t(state_.load(std::memory_order_seq_cst) >> epoch_shift) != key; });
+			}
+			state_.fetch_sub(waiter_inc, std::memory_order_seq_cst);
+			return notified;
+		};
+
+		void notify_one(){ notify(false); };
+		void notify_all(){ notify(true); };
+
+		// Threads between prepare_wait and the end of wait/cancel_wait
+		std::uint32_t waiters() const { return std::uint32_t(state_.load() & waiter_mask); };
+
+	private:
+		void notify(bool all){
+			// Pairs with the fetch_add in prepare_wait, the caller published its work before this
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if ((state_.load(std::memory_order_seq_cst) & waiter_mask) == 0) return;
+			{
+				std::lock_guard<std::mutex> guard(mtx_);
+				state_.fetch_add(epoch_inc, std::memory_order_seq_cst);
+			}
+			if (all) cv_.notify_all();
+			else cv_.notify_one();
+		};
+
+		// Low 32 bits: number of waiters, high 32 bits: epoch bumped by every notify
+		static constexpr std::uint64_t waiter_inc = 1;
+		static constexpr std::uint64_t waiter_mask = 0xFFFFFFFF;
+		static constexpr int epoch_shift = 32;
+		static constexpr std::uint64_t epoch_inc = std::uint64_t(1) << epoch_shift;
+
+		std::atomic<std::uint64_t> state_{0};
+		std::mutex mtx_;
+		std::condition_variable cv_;
+};
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+
+// Discrete-event simulation core: a virtual clock and the events that are going to happen,
+// ordered by time in a binary heap. Nothing sleeps, run() jumps the clock from one event to
+// the next, so simulating days takes as long as handling the events. Events due at the
+// same time come out in the order they were scheduled, which keeps every run repeatable.
+//
+//     event_simulation<my_event> sim;
+//     sim.schedule_at(0, my_event{...});
+//     sim.run([&](const my_event& e){ ...; sim.schedule_after(10, my_event{...}); });
+//
+// The model owns all the state, an event is just what the handler needs to know which
+// part of the model changes. Keep it small, it gets moved around in the heap.
+template <typename Event>
+class event_simulation{
+	public:
+		using time_type = double;
+
+		time_type now() const { return now_; };
+
+		void schedule_at(time_type time, Event event){
+			if (time < now_) throw std::invalid_argument("An event can't be scheduled in the past.");
+			heap_.push_back(entry{time, next_seq_++, std::move(event)});
+			std::push_heap(heap_.begin(), heap_.end(), later{});
+		};
+		void schedule_after(time_type delay, Event event){ schedule_at(now_ + delay, std::move(event)); };
+
+		// Hands events to `handle` in time order until none are left or the next one is after
+		// `until`, returns how many it handled. The handler may schedule more events.
+		template <typename Handler>
+		std::size_t run(Handler&& handle, time_type until=std::numeric_limits<time_type>::infinity()){
+			std::size_t handled = 0;
+			while (!heap_.empty() && heap_.front().time <= until){
+				std::pop_heap(heap_.begin(), heap_.end(), later{});
+				entry e = std::move(heap_.back());
+				heap_.pop_back();
+				now_ = e.time;
+				handle(e.event);
+				++handled;
+			}
+			processed_ += handled;
+			return handled;
+		};
+
+		bool empty() const { return heap_.empty(); };
+		std::size_t size() const { return heap_.size(); };
+		std::size_t processed() const { return processed_; };
+		void reserve(std::size_t events){ heap_.reserve(events); };
+
+	private:
+		struct entry{
+			time_type time;
+			std::uint64_t seq; // breaks ties, first scheduled first handled
+			Event event;
+		};
+		// std heap functions keep the largest element in front, so "larger" means later
+		struct later{
+			bool operator()(const entry& a, const entry& b) const {
+				return a.time > b.time || (a.time == b.time && a.seq > b.seq);
+			};
+		};
+
+		std::vector<entry> heap_;
+		time_type now_ = 0;
+		std::uint64_t next_seq_ = 0;
+		std::size_t processed_ = 0;
+};
@@ -18,6 +18,8 @@ Took 1427[ms]: Total time
 #include <fstream>
 #include <sstream>
 
+#include "task_graph.hpp"
+
 
 using namespace std;
 
@@ -171,55 +173,71 @@ int main()
 
 
     size_t globalWorkSize = imageSize;
-    begin = chrono::high_resolution_clock::now();
-    // Generate random pixels for image1
     unsigned long seedImg1 = 0;
-    generateRandomPixelsKernel.setArg(0, oclBufferImage1);
-    generateRandomPixelsKernel.setArg(1, imageSize);
-    generateRandomPixelsKernel.setArg(2, seedImg1);
-    queue.enqueueNDRangeKernel(generateRandomPixelsKernel, cl::NullRange, globalWorkSize, cl::NullRange);
-    queue.finish();
-    // Read result back from OpenCL device
-    queue.enqueueReadBuffer(oclBufferImage1, CL_TRUE, 0, sizeof(Pixel) * imageSize, image1);
-    queue.finish();
-
-    // Generate random pixels for image2
-    // unsigned long seedImg2 = 0;
-    generateRandomPixelsKernel.setArg(0, oclBufferImage2);
-    generateRandomPixelsKernel.setArg(1, imageSize);
-    generateRandomPixelsKernel.setArg(2, seedImg1);
-    queue.enqueueNDRangeKernel(generateRandomPixelsKernel, cl::NullRange, globalWorkSize, cl::NullRange);
-    queue.finish();
-    // Read result back from OpenCL device
-    queue.enqueueReadBuffer(oclBufferImage2, CL_TRUE, 0, sizeof(Pixel) * imageSize, image2);
-    queue.finish();
-    // Filled with random pixels
-    end = chrono::high_resolution_clock::now();
-    std::cout << "Took " << chrono::duration_cast<chrono::milliseconds>(end - begin).count() << "[ms]: To fill images with random pixels" << std::endl;
 
-
-    std::cout << "seed val1: " << seedImg1 << std::endl;
-    // std::cout << "seed val2: " << seedImg2 << std::endl;
+    // The two images don't depend on each other, so each one gets its own kernel object and
+    // in-order command queue and both are generated at the same time:
+    //   generate image1 --+
+    //                     +--> add --> read back
+    //   generate image2 --+
+    thread_pool pool(2);
+    task_graph graph(pool);
+    cl::CommandQueue queueImg1(context, default_device);
+    cl::CommandQueue queueImg2(context, default_device);
+    cl::Kernel generateImage1Kernel(program, "generateRandomPixels");
+    cl::Kernel generateImage2Kernel(program, "generateRandomPixels");
+    long long generateImage1Ms = 0, generateImage2Ms = 0, addMs = 0, readBackMs = 0;
+
+    auto generateImage1 = graph.add([&]() {
+        auto begin = chrono::high_resolution_clock::now();
+        generateImage1Kernel.setArg(0, oclBufferImage1);
+        generateImage1Kernel.setArg(1, imageSize);
+        generateImage1Kernel.setArg(2, seedImg1);
+        queueImg1.enqueueNDRangeKernel(generateImage1Kernel, cl::NullRange, globalWorkSize, cl::NullRange);
+        queueImg1.enqueueReadBuffer(oclBufferImage1, CL_TRUE, 0, sizeof(Pixel) * imageSize, image1);
+        generateImage1Ms = chrono::duration_cast<chrono::milliseconds>(chrono::high_resolution_clock::now() - begin).count();
+    });
+    auto generateImage2 = graph.add([&]() {
+        auto begin = chrono::high_resolution_clock::now();
+        generateImage2Kernel.setArg(0, oclBufferImage2);
+        generateImage2Kernel.setArg(1, imageSize);
+        generateImage2Kernel.setArg(2, seedImg1);
+        queueImg2.enqueueNDRangeKernel(generateImage2Kernel, cl::NullRange, globalWorkSize, cl::NullRange);
+        queueImg2.enqueueReadBuffer(oclBufferImage2, CL_TRUE, 0, sizeof(Pixel) * imageSize, image2);
+        generateImage2Ms = chrono::duration_cast<chrono::milliseconds>(chrono::high_resolution_clock::now() - begin).count();
+    });
+    auto addImages = graph.add([&]() {
+        auto begin = chrono::high_resolution_clock::now();
+        // OpenCL addPixelColorsKernel to result
+        addPixelColorsKernel.setArg(0, oclBufferImage1);
+        addPixelColorsKernel.setArg(1, oclBufferImage2);
+        addPixelColorsKernel.setArg(2, oclBufferResult);
+        addPixelColorsKernel.setArg(3, imageSize);
+        queue.enqueueNDRangeKernel(addPixelColorsKernel, cl::NullRange, globalWorkSize, cl::NullRange);
+        queue.finish();
+        addMs = chrono::duration_cast<chrono::milliseconds>(chrono::high_resolution_clock::now() - begin).count();
+    }, {generateImage1, generateImage2});
+    graph.add([&]() {
+        auto begin = chrono::high_resolution_clock::now();
+        // Read result back from OpenCL device
+        queue.enqueueReadBuffer(oclBufferResult, CL_TRUE, 0, sizeof(Pixel) * imageSize, result);
+        readBackMs = chrono::duration_cast<chrono::milliseconds>(chrono::high_resolution_clock::now() - begin).count();
+    }, {addImages});
 
     begin = chrono::high_resolution_clock::now();
-    // OpenCL addPixelColorsKernel to result
-    addPixelColorsKernel.setArg(0, oclBufferImage1);
-    addPixelColorsKernel.setArg(1, oclBufferImage2);
-    addPixelColorsKernel.setArg(2, oclBufferResult);
-    addPixelColorsKernel.setArg(3, imageSize);
-    queue.enqueueNDRangeKernel(addPixelColorsKernel, cl::NullRange, globalWorkSize, cl::NullRange);
-    queue.finish();
-    // OpenCL addPixelColorsKernel arguments set
+    graph.run();
     end = chrono::high_resolution_clock::now();
-    std::cout << "Took " << chrono::duration_cast<chrono::milliseconds>(end - begin).count() << "[ms]: To set OpenCL addPixelColorsKernel arguments" << std::endl;
-
+    std::cout << "Took " << generateImage1Ms << "[ms] and " << generateImage2Ms << "[ms]: To fill images with random pixels (overlapped)" << std::endl;
+    std::cout << "seed val1: " << seedImg1 << std::endl;
+    std::cout << "Took " << addMs << "[ms]: To set OpenCL addPixelColorsKernel arguments" << std::endl;
+    std::cout << "Took " << readBackMs << "[ms]: To read result back from OpenCL device" << std::endl;
+    std::cout << "Took " << chrono::duration_cast<chrono::milliseconds>(end - begin).count() << "[ms]: To run the whole image graph" << std::endl;
 
+    // The graph is reusable, running it again costs no new allocations
     begin = chrono::high_resolution_clock::now();
-    // Read result back from OpenCL device
-    queue.enqueueReadBuffer(oclBufferResult, CL_TRUE, 0, sizeof(Pixel) * imageSize, result);
-    // Result read back from OpenCL device
+    graph.run();
     end = chrono::high_resolution_clock::now();
-    std::cout << "Took " << chrono::duration_cast<chrono::milliseconds>(end - begin).count() << "[ms]: To read result back from OpenCL device" << std::endl;
+    std::cout << "Took " << chrono::duration_cast<chrono::milliseconds>(end - begin).count() << "[ms]: To run the image graph again" << std::endl;
     
 
     end = chrono::high_resolution_clock::now();
@@ -10,6 +10,8 @@ Execution time using 8 threads: 35789[ms]
 #include <chrono>
 #include <thread>
 
+#include "threadpool.hpp"
+
 using namespace std;
 
 
@@ -61,19 +63,14 @@ int main()
 	Pixel* image2 = new Pixel[imageSize];
 	Pixel* result = new Pixel[imageSize];
 
-	int num_threads = 8;
-	thread threads[num_threads];
-
-    for (int i = 0; i < num_threads; i++)
-    {
-        // Split sections of the image to different threads
-        threads[i] = thread(work_on_pixels, i * (imageSize / num_threads), (i + 1) * (imageSize / num_threads), image1, image2, result);
-    }
-
-    for (int i = 0; i < num_threads; i++)
-    {
-        threads[i].join();
-    }
+	// One pool per NUMA node with the workers scattered over the physical cores. The pixels are
+	// first touched by the node that processes them, so every node streams from its own memory.
+	numa_pools pools(pool_options{.place = placement::scatter});
+	int num_threads = 0;
+	for (size_t i = 0; i < pools.size(); i++) num_threads += pools[i].size();
+	pools.parallel_for(0, imageSize, 0, [=](size_t i){
+		work_on_pixels(i, i + 1, image1, image2, result);
+	});
 
     auto end = chrono::high_resolution_clock::now();
 
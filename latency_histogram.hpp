@@ -0,0 +1,83 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+
+
+// Lock-free histogram of durations in nanoseconds for percentile reporting.
+// Buckets are log-linear: every power of two is split into sub_buckets equal parts, so a
+// reported percentile is at most 1/sub_buckets (25%) above the real value while the whole
+// histogram stays a fixed array of counters any thread can bump with one atomic add.
+class latency_histogram{
+	public:
+		void record(std::uint64_t ns){
+			buckets_[bucket_of(ns)].fetch_add(1, std::memory_order_relaxed);
+			count_.fetch_add(1, std::memory_order_relaxed);
+			total_.fetch_add(ns, std::memory_order_relaxed);
+			std::uint64_t max = max_.load(std::memory_order_relaxed);
+			while (ns > max && !max_.compare_exchange_weak(max, ns, std::memory_order_relaxed)){}
+		};
+
+		std::uint64_t count() const { return count_.load(std::memory_order_relaxed); };
+		std::uint64_t total_ns() const { return total_.load(std::memory_order_relaxed); };
+		std::uint64_t max_ns() const { return max_.load(std::memory_order_relaxed); };
+		double mean_ns() const {
+			std::uint64_t n = count();
+			return n ? double(total_ns()) / double(n) : 0.0;
+		};
+
+		// Upper edge of the bucket holding the p-th fraction of the samples (p in [0, 1])
+		std::uint64_t percentile_ns(double p) const {
+			std::uint64_t n = count();
+			if (!n) return 0;
+			std::uint64_t rank = std::uint64_t(p * double(n - 1)) + 1;
+			std::uint64_t seen = 0;
+			for (std::size_t i=0; i<bucket_count; ++i){
+				seen += buckets_[i].load(std::memory_order_relaxed);
+				if (seen >= rank){
+					std::uint64_t edge = upper_edge(i);
+					return edge < max_ns() ? edge : max_ns();
+				}
+			}
+			return max_ns();
+		};
+
+		// Adds the samples of `other`, handy for combining per-thread histograms
+		void merge(const latency_histogram& other){
+			for (std::size_t i=0; i<bucket_count; ++i) buckets_[i].fetch_add(other.buckets_[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+			count_.fetch_add(other.count(), std::memory_order_relaxed);
+			total_.fetch_add(other.total_ns(), std::memory_order_relaxed);
+			std::uint64_t ns = other.max_ns();
+			std::uint64_t max = max_.load(std::memory_order_relaxed);
+			while (ns > max && !max_.compare_exchange_weak(max, ns, std::memory_order_relaxed)){}
+		};
+
+	private:
+		static constexpr std::size_t sub_bits = 2;
+		static constexpr std::size_t sub_buckets = std::size_t(1) << sub_bits;
+		static constexpr std::size_t bucket_count = 64 * sub_buckets;
+
+		// Values below sub_buckets get a bucket each, above that the bucket is the position
+		// of the highest set bit plus the next sub_bits bits under it
+		static std::size_t bucket_of(std::uint64_t ns){
+			if (ns < sub_buckets) return std::size_t(ns);
+			std::size_t high = std::size_t(63 - std::countl_zero(ns));
+			std::size_t sub = std::size_t(ns >> (high - sub_bits)) & (sub_buckets - 1);
+			return (high - sub_bits + 1) * sub_buckets + sub;
+		};
+		static std::uint64_t upper_edge(std::size_t bucket){
+			if (bucket < sub_buckets) return bucket;
+			std::size_t high = bucket / sub_buckets + sub_bits - 1;
+			std::uint64_t sub = bucket % sub_buckets;
+			std::uint64_t base = (std::uint64_t(1) << high) + (sub << (high - sub_bits));
+			return base + (std::uint64_t(1) << (high - sub_bits)) - 1;
+		};
+
+		std::array<std::atomic<std::uint64_t>, bucket_count> buckets_{};
+		std::atomic<std::uint64_t> count_{0};
+		std::atomic<std::uint64_t> total_{0};
+		std::atomic<std::uint64_t> max_{0};
+};
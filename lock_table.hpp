@@ -0,0 +1,111 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <vector>
+
+
+// A fixed number of mutexes ("stripes") shared by any number of objects, the object with key k
+// uses stripe hash(k) % stripes. A million accounts don't need a million mutexes, and two
+// objects only wait for each other when they share a stripe. One stripe is a global lock.
+//
+//     lock_table locks(1024);
+//     {
+//         auto guard = locks.lock({from, to}); // both stripes, deadlock free
+//         ...
+//     }
+//
+// lock() takes the stripes of a whole set of keys in stripe order and each one once, like
+// std::scoped_lock does, so threads locking overlapping sets can't deadlock.
+class lock_table{
+	private:
+		struct alignas(64) stripe_t{ std::mutex mtx; }; // a cache line each, no false sharing
+
+	public:
+		// Holds the stripes of one lock() call until it goes out of scope
+		class guard{
+			public:
+				guard(guard&& other) noexcept : table_(other.table_), count_(other.count_), inline_(other.inline_), more_(std::move(other.more_)){
+					other.count_ = 0;
+				};
+				guard& operator = (guard&&) = delete;
+				guard(const guard&) = delete;
+				~guard(){
+					const std::size_t* held = more_.empty() ? inline_.data() : more_.data();
+					for (std::size_t i=count_; i>0; --i) table_->stripes_[held[i - 1]].mtx.unlock();
+				};
+
+			private:
+				friend class lock_table;
+				explicit guard(lock_table* table) : table_(table){};
+
+				lock_table* table_;
+				std::size_t count_ = 0;
+				// Most transactions touch a few keys, their stripes fit without allocating
+				std::array<std::size_t, 8> inline_{};
+				std::vector<std::size_t> more_;
+		};
+
+		// Rounded up to a power of two
+		explicit lock_table(std::size_t stripes=1024){
+			if (!stripes) throw std::invalid_argument("A lock table needs at least one stripe.");
+			std::size_t n = 1;
+			while (n < stripes) n <<= 1;
+			mask_ = n - 1;
+			stripes_ = std::make_unique<stripe_t[]>(n);
+		};
+
+		std::size_t size() const { return mask_ + 1; };
+
+		// Keys that are neighbours (account 17 and 18) end up on unrelated stripes
+		std::size_t stripe_of(std::uint64_t key) const {
+			key ^= key >> 33;
+			key *= 0xff51afd7ed558ccdull;
+			key ^= key >> 33;
+			return std::size_t(key) & mask_;
+		};
+
+		template <typename Keys>
+		guard lock(const Keys& keys){
+			guard g(this);
+			std::size_t* held = g.inline_.data();
+			if (std::size(keys) > g.inline_.size()){
+				g.more_.resize(std::size(keys));
+				held = g.more_.data();
+			}
+			std::size_t n = 0;
+			for (auto key : keys) held[n++] = stripe_of(std::uint64_t(key));
+			std::sort(held, held + n);
+			n = std::size_t(std::unique(held, held + n) - held);
+			for (std::size_t i=0; i<n; ++i){
+				stripes_[held[i]].mtx.lock();
+				g.count_ = i + 1;
+			}
+			return g;
+		};
+		guard lock(std::initializer_list<std::uint64_t> keys){ return lock<std::initializer_list<std::uint64_t>>(keys); };
+
+		// Every stripe, for looking at everything at once
+		guard lock_all(){
+			guard g(this);
+			g.more_.resize(size());
+			for (std::size_t i=0; i<size(); ++i){
+				g.more_[i] = i;
+				stripes_[i].mtx.lock();
+				g.count_ = i + 1;
+			}
+			return g;
+		};
+
+	private:
+		std::size_t mask_;
+		std::unique_ptr<stripe_t[]> stripes_;
+};
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <vector>
+
+#include "threadpool.hpp"
+
+
+// Mean of independent samples with a 95% confidence interval, mean +- half_width
+struct estimate{
+	double mean = 0;
+	double half_width = 0;
+	double min = 0;
+	double max = 0;
+	std::size_t samples = 0;
+
+	double low() const { return mean - half_width; };
+	double high() const { return mean + half_width; };
+};
+
+// Student's t quantiles for 97.5% up to 30 degrees of freedom, the normal 1.96 above
+inline double t_quantile_975(std::size_t degrees_of_freedom){
+	static constexpr double table[] = {
+		12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+		2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+		2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042,
+	};
+	if (!degrees_of_freedom) return INFINITY;
+	return degrees_of_freedom <= 30 ? table[degrees_of_freedom - 1] : 1.96;
+}
+
+inline estimate estimate_of(const std::vector<double>& samples){
+	estimate e;
+	e.samples = samples.size();
+	if (samples.empty()) return e;
+	double total = 0;
+	for (double s : samples) total += s;
+	e.mean = total / double(samples.size());
+	double squares = 0;
+	for (double s : samples) squares += (s - e.mean) * (s - e.mean);
+	if (samples.size() > 1){
+		double stddev = std::sqrt(squares / double(samples.size() - 1));
+		e.half_width = t_quantile_975(samples.size() - 1) * stddev / std::sqrt(double(samples.size()));
+	}
+	e.min = *std::min_element(samples.begin(), samples.end());
+	e.max = *std::max_element(samples.begin(), samples.end());
+	return e;
+}
+
+// splitmix64, turns consecutive numbers into well spread seeds
+inline std::uint64_t mix_seed(std::uint64_t x){
+	x += 0x9e3779b97f4a7c15ull;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+	return x ^ (x >> 31);
+}
+
+// Runs `replications` independent replications of `f(seed)` on the pool (several at once,
+// so `f` must not share mutable state) and returns their results in replication order.
+// Replication i always gets the same seed for the same `seed`, so a run can be repeated
+// exactly no matter how the pool schedules it. The first exception of `f` is rethrown.
+template <typename F>
+auto replicate(thread_pool& pool, std::size_t replications, std::uint64_t seed, F&& f) -> std::vector<std::invoke_result_t<F&, std::uint64_t>>{
+	std::vector<std::invoke_result_t<F&, std::uint64_t>> results(replications);
+	pool.parallel_for(0, replications, 1, [&results, &f, seed](std::size_t i){ results[i] = f(mix_seed(seed + i)); });
+	return results;
+}
@@ -0,0 +1,169 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <utility>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+
+// Tell the CPU we are in a spin loop (x86 `pause`, ARM `yield`), it saves power and
+// stops the spinning thread from starving its SMT sibling.
+inline void cpu_relax(){
+#if defined(__x86_64__) || defined(__i386__)
+	_mm_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+	asm volatile("yield");
+#endif
+}
+
+
+// Bounded multi-producer multi-consumer ring buffer without locks.
+// source: https://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+// Every slot carries a sequence number that tells whether it is ready to be written
+// (seq == pos) or ready to be read (seq == pos + 1). Producers and consumers claim a
+// position with a CAS on their own counter and never touch each other's cache line.
+template <typename T>
+class bounded_mpmc_queue{
+	public:
+		bounded_mpmc_queue(const bounded_mpmc_queue&) = delete;
+		bounded_mpmc_queue& operator = (const bounded_mpmc_queue&) = delete;
+
+		explicit bounded_mpmc_queue(std::size_t capacity)
+			: mask_(capacity - 1), slots_(std::make_unique<slot[]>(capacity)){
+			if (capacity < 2 || (capacity & (capacity - 1)) != 0) throw std::invalid_argument("Queue capacity must be a power of two.");
+			for (std::size_t i=0; i<capacity; ++i) slots_[i].seq.store(i, std::memory_order_relaxed);
+		};
+
+		// Moves `value` into the queue, leaves it untouched and returns false when full
+		bool try_push(T& value){
+			std::size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+			while (true){
+				slot& s = slots_[pos & mask_];
+				std::size_t seq = s.seq.load(std::memory_order_acquire);
+				std::ptrdiff_t diff = std::ptrdiff_t(seq) - std::ptrdiff_t(pos);
+				if (diff == 0){
+					if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)){
+						s.value = std::move(value);
+						s.seq.store(pos + 1, std::memory_order_release);
+						return true;
+					}
+				}
+				else if (diff < 0) return false; // the slot still holds a value from the previous lap
+				else pos = enqueue_pos_.load(std::memory_order_relaxed);
+			}
+		};
+
+		// Moves the oldest value into `value`, returns false when empty
+		bool try_pop(T& value){
+			std::size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+			while (true){
+				slot& s = slots_[pos & mask_];
+				std::size_t seq = s.seq.load(std::memory_order_acquire);
+				std::ptrdiff_t diff = std::ptrdiff_t(seq) - std::ptrdiff_t(pos + 1);
+				if (diff == 0){
+					if (dequeue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)){
+						value = std::move(s.value);
+						s.value = T{};
+						s.seq.store(pos + mask_ + 1, std::memory_order_release);
+						return true;
+					}
+				}
+				else if (diff < 0) return false; // nothing published in this slot yet
+				else pos = dequeue_pos_.load(std::memory_order_relaxed);
+			}
+		};
+
+		// Only a snapshot, other threads may change it right after
+		bool empty() const {
+			return enqueue_pos_.load(std::memory_order_seq_cst) == dequeue_pos_.load(std::memory_order_seq_cst);
+		};
+		std::size_t size() const {
+			std::size_t dequeued = dequeue_pos_.load(std::memory_order_relaxed);
+			std::size_t enqueued = enqueue_pos_.load(std::memory_order_relaxed);
+			return enqueued > dequeued ? std::min(enqueued - dequeued, mask_ + 1) : 0;
+		};
+		std::size_t capacity() const { return mask_ + 1; };
+
+	private:
+		static constexpr std::size_t cache_line = 64;
+
+		struct alignas(cache_line) slot{
+			std::atomic<std::size_t> seq;
+			T value{};
+		};
+
+		const std::size_t mask_;
+		std::unique_ptr<slot[]> slots_;
+		alignas(cache_line) std::atomic<std::size_t> enqueue_pos_{0};
+		alignas(cache_line) std::atomic<std::size_t> dequeue_pos_{0};
+};
+
+
+// Bounded single-producer single-consumer ring buffer (Lamport queue).
+// Only one thread pushes and only one pops, so each side owns its index and never needs
+// a CAS. Both sides cache the other side's index and only reload it when the ring looks
+// full (producer) or empty (consumer), which keeps the shared cache lines quiet.
+template <typename T>
+class bounded_spsc_queue{
+	public:
+		bounded_spsc_queue(const bounded_spsc_queue&) = delete;
+		bounded_spsc_queue& operator = (const bounded_spsc_queue&) = delete;
+
+		explicit bounded_spsc_queue(std::size_t capacity)
+			: mask_(capacity - 1), slots_(std::make_unique<T[]>(capacity)){
+			if (capacity < 2 || (capacity & (capacity - 1)) != 0) throw std::invalid_argument("Queue capacity must be a power of two.");
+		};
+
+		// Producer only. Moves `value` into the queue, leaves it untouched and returns false when full
+		bool try_push(T& value){
+			std::size_t tail = tail_.load(std::memory_order_relaxed);
+			if (tail - head_cache_ > mask_){
+				head_cache_ = head_.load(std::memory_order_acquire);
+				if (tail - head_cache_ > mask_) return false;
+			}
+			slots_[tail & mask_] = std::move(value);
+			tail_.store(tail + 1, std::memory_order_release);
+			return true;
+		};
+
+		// Consumer only. Moves the oldest value into `value`, returns false when empty
+		bool try_pop(T& value){
+			std::size_t head = head_.load(std::memory_order_relaxed);
+			if (head == tail_cache_){
+				tail_cache_ = tail_.load(std::memory_order_acquire);
+				if (head == tail_cache_) return false;
+			}
+			value = std::move(slots_[head & mask_]);
+			slots_[head & mask_] = T{};
+			head_.store(head + 1, std::memory_order_release);
+			return true;
+		};
+
+		// Only a snapshot, other threads may change it right after
+		bool empty() const {
+			return tail_.load(std::memory_order_seq_cst) == head_.load(std::memory_order_seq_cst);
+		};
+		std::size_t size() const {
+			std::size_t head = head_.load(std::memory_order_relaxed);
+			std::size_t tail = tail_.load(std::memory_order_relaxed);
+			return tail > head ? tail - head : 0;
+		};
+		std::size_t capacity() const { return mask_ + 1; };
+
+	private:
+		static constexpr std::size_t cache_line = 64;
+
+		const std::size_t mask_;
+		std::unique_ptr<T[]> slots_;
+		alignas(cache_line) std::atomic<std::size_t> tail_{0};
+		std::size_t head_cache_ = 0; // producer's copy of head_
+		alignas(cache_line) std::atomic<std::size_t> head_{0};
+		std::size_t tail_cache_ = 0; // consumer's copy of tail_
+};
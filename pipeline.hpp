@@ -0,0 +1,756 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include "mpmc_queue.hpp"
+#include "event_count.hpp"
+
+
+// Bounded queue between two pipeline stages that knows when its stream ends.
+// Every producer calls producer_done() when it has nothing more to push and once the
+// last one did, pop() returns std::nullopt after the remaining items are gone.
+// open() picks a lock-free SPSC ring when exactly one thread pushes and one pops,
+// the MPMC ring otherwise. Full and empty waits spin briefly and then park.
+template <typename T>
+class channel{
+	public:
+		explicit channel(std::size_t capacity) : capacity_(std::bit_ceil(std::max<std::size_t>(capacity, 2))){};
+		channel(const channel&) = delete;
+		channel& operator = (const channel&) = delete;
+
+		// Both sides have to be counted before open(). A channel without consumers is the
+		// pipeline's output and counts as one, the thread calling pipeline::pop().
+		void add_producers(std::size_t n){ producers_.fetch_add(n); };
+		void add_consumers(std::size_t n){ consumers_ += n; };
+		void open(){
+			if (producers_.load() == 1 && consumers_ <= 1) spsc_ = std::make_unique<bounded_spsc_queue<std::optional<T>>>(capacity_);
+			else mpmc_ = std::make_unique<bounded_mpmc_queue<std::optional<T>>>(capacity_);
+		};
+		bool is_spsc() const { return spsc_ != nullptr; };
+		// Items waiting, only a snapshot
+		std::size_t size() const { return spsc_ ? spsc_->size() : mpmc_ ? mpmc_->size() : 0; };
+
+		// Blocks while the channel is full. Returns false when the channel got cancelled
+		// and the item was dropped.
+		bool push(T item){
+			std::optional<T> value(std::move(item));
+			for (std::size_t spin=0; !try_push(value); ++spin){
+				if (cancelled_.load()) return false;
+				if (spin < spin_count){
+					cpu_relax();
+					continue;
+				}
+				event_count::key_t key = not_full_.prepare_wait();
+				if (try_push(value)){
+					not_full_.cancel_wait();
+					break;
+				}
+				if (cancelled_.load()){
+					not_full_.cancel_wait();
+					return false;
+				}
+				not_full_.wait(key);
+			}
+			not_empty_.notify_one();
+			return true;
+		};
+
+		// Blocks while the channel is empty. std::nullopt means end of stream (or cancelled).
+		std::optional<T> pop(){
+			std::optional<T> value;
+			for (std::size_t spin=0; !try_pop(value); ++spin){
+				if (cancelled_.load()) return std::nullopt;
+				if (closed_.load()){
+					// Every push happened before closed_ was set, one last look decides
+					if (try_pop(value)) break;
+					return std::nullopt;
+				}
+				if (spin < spin_count){
+					cpu_relax();
+					continue;
+				}
+				event_count::key_t key = not_empty_.prepare_wait();
+				if (try_pop(value)){
+					not_empty_.cancel_wait();
+					break;
+				}
+				if (closed_.load() || cancelled_.load()){
+					not_empty_.cancel_wait();
+					continue;
+				}
+				not_empty_.wait(key);
+			}
+			not_full_.notify_one();
+			return value;
+		};
+
+		void producer_done(){
+			if (producers_.fetch_sub(1) != 1) return;
+			closed_.store(true);
+			not_empty_.notify_all();
+		};
+
+		// Wakes everybody up, pushes drop their item and pops report the end of the stream
+		void cancel(){
+			cancelled_.store(true);
+			not_empty_.notify_all();
+			not_full_.notify_all();
+		};
+
+	private:
+		static constexpr std::size_t spin_count = 64;
+
+		bool try_push(std::optional<T>& value){ return spsc_ ? spsc_->try_push(value) : mpmc_->try_push(value); };
+		bool try_pop(std::optional<T>& value){ return spsc_ ? spsc_->try_pop(value) : mpmc_->try_pop(value); };
+
+		const std::size_t capacity_;
+		std::unique_ptr<bounded_spsc_queue<std::optional<T>>> spsc_;
+		std::unique_ptr<bounded_mpmc_queue<std::optional<T>>> mpmc_;
+		std::atomic<std::size_t> producers_{0};
+		std::size_t consumers_ = 0;
+		std::atomic<bool> closed_{false};
+		std::atomic<bool> cancelled_{false};
+		event_count not_empty_;
+		event_count not_full_;
+};
+
+
+// What one stage has done so far
+struct stage_stats{
+	std::string name;
+	std::size_t workers = 0;     // working right now, the balancer may change it
+	std::size_t items = 0;       // items the stage function finished
+	bool spsc_input = false;     // fed by the single-producer single-consumer ring
+	double mean_service_ms = 0;  // per item, only measured by balanced or traced pipelines
+};
+
+// What happened to one item at one stage, nanoseconds since the pipeline started.
+// `item` counts the pushes into the pipeline from 0.
+struct trace_record{
+	std::uint64_t item;
+	std::uint32_t stage;
+	std::int64_t enqueued_ns; // pushed into the stage's input channel
+	std::int64_t start_ns;    // a worker took it out and called the stage function
+	std::int64_t finish_ns;   // the stage function returned
+};
+
+struct latency_summary{
+	double mean_ms = 0;
+	double p50_ms = 0;
+	double p99_ms = 0;
+	double max_ms = 0;
+};
+
+struct stage_latency{
+	std::string name;
+	latency_summary queueing; // waiting in the input channel
+	latency_summary service;  // in the stage function
+};
+
+struct trace_report{
+	std::vector<stage_latency> stages;
+	latency_summary end_to_end; // pushed into the pipeline to done with the last stage
+	std::size_t items = 0;      // made it through every stage
+	// Items per second without the first and the last 10% of them, when the pipeline is
+	// still filling up or already draining
+	double steady_throughput = 0;
+};
+
+namespace detail{
+	// What the channels between the stages carry: the item and when it was pushed
+	template <typename T>
+	struct stamped{
+		T value;
+		std::uint64_t item;
+		std::int64_t enqueued_ns;
+	};
+
+	// Exact percentiles, sorts `ns`
+	inline latency_summary summarize(std::vector<std::int64_t>& ns){
+		latency_summary summary;
+		if (ns.empty()) return summary;
+		std::sort(ns.begin(), ns.end());
+		double total = 0;
+		for (std::int64_t v : ns) total += double(v);
+		auto at = [&ns](double p){ return double(ns[std::size_t(p * double(ns.size() - 1))]) / 1e6; };
+		summary.mean_ms = total / double(ns.size()) / 1e6;
+		summary.p50_ms = at(0.50);
+		summary.p99_ms = at(0.99);
+		summary.max_ms = double(ns.back()) / 1e6;
+		return summary;
+	}
+
+	// Everything the stages of one pipeline share. The pipeline<> handles returned by then()
+	// all point here, whichever goes last joins the worker threads.
+	struct pipeline_state{
+		struct stage_t{
+			std::string name;
+			std::atomic<std::size_t> workers{0}; // worker threads with an index below it pop items
+			std::size_t threads = 0;
+			std::size_t max_workers = 0;         // the most the balancer may give the stage
+			bool async = false;                  // then_async(): workers is how many items may be in flight
+			std::atomic<std::size_t> items{0};
+			std::atomic<std::uint64_t> busy_ns{0};
+			std::atomic<bool> input_done{false};
+			// Wakes parked workers when the worker count changes or the input ends. Asynchronous
+			// stages also wait on it for completions, which may come after the stage is gone.
+			std::shared_ptr<event_count> resized = std::make_shared<event_count>();
+			std::function<bool()> spsc_input;
+			std::function<std::size_t()> backlog;     // items waiting in the input channel
+			std::function<void(std::size_t)> connect; // counts the threads on both channels
+			std::function<void(std::size_t, std::vector<trace_record>*)> work; // body of worker thread n
+
+			// Parks worker `n` while the balancer gave its place to another stage. False once
+			// the input has ended and the worker should leave.
+			bool wait_turn(std::size_t n){
+				while (true){
+					if (input_done.load()) return false;
+					if (n < workers.load(std::memory_order_relaxed)) return true;
+					event_count::key_t key = resized->prepare_wait();
+					if (input_done.load() || n < workers.load()){
+						resized->cancel_wait();
+						continue;
+					}
+					resized->wait(key);
+				}
+			};
+			void finish_input(){
+				input_done.store(true);
+				resized->notify_all();
+			};
+			double mean_service_ns() const {
+				std::size_t n = items.load();
+				return n ? double(busy_ns.load()) / double(n) : 0;
+			};
+		};
+
+		std::vector<std::unique_ptr<stage_t>> stages;
+		std::vector<std::function<void()>> open_channels;
+		std::vector<std::function<void()>> cancel_channels;
+		std::vector<std::thread> threads;
+		std::chrono::steady_clock::time_point epoch;
+		std::uint64_t pushed = 0; // only touched by the thread calling push()
+
+		// Tracing, every worker thread writes to its own buffer and nobody reads them before join()
+		bool tracing = false;
+		std::vector<std::vector<trace_record>> trace_buffers;
+		std::once_flag started;
+		bool joined = false;
+		std::atomic<bool> failed{false};
+		std::mutex mtx_error;
+		std::exception_ptr error;
+
+		// Balancing, worker_budget 0 keeps the worker counts given to then()
+		std::size_t worker_budget = 0;
+		std::chrono::milliseconds balance_interval{10};
+		std::atomic<std::size_t> moves{0};
+		std::thread balancer;
+		std::mutex mtx_balancer;
+		std::condition_variable cv_balancer;
+		bool stop_balancer = false;
+
+		// First error wins, the channels get cancelled so every stage winds down
+		void fail(std::exception_ptr e){
+			{
+				std::lock_guard<std::mutex> guard(mtx_error);
+				if (!error) error = e;
+			}
+			if (!failed.exchange(true)){
+				for (auto& cancel : cancel_channels) cancel();
+				for (auto& st : stages) st->finish_input();
+			}
+		};
+
+		void start(){
+			std::call_once(started, [this](){
+				std::size_t assigned = 0;
+				for (auto& st : stages) assigned += st->workers;
+				if (worker_budget && assigned > worker_budget) throw std::logic_error("The stages start with more workers than the budget allows.");
+				// A balanced stage gets a thread for every worker it could ever have, the
+				// ones above its current count stay parked. An asynchronous stage has two
+				// threads whatever its worker count, one starts items and one passes them on.
+				for (auto& st : stages){
+					st->max_workers = worker_budget ? worker_budget - (stages.size() - 1) : st->workers.load();
+					st->threads = st->async ? 2 : st->max_workers;
+					st->connect(st->async ? 1 : st->threads);
+				}
+				for (auto& open : open_channels) open();
+				std::size_t thread_count = 0;
+				for (auto& st : stages) thread_count += st->threads;
+				if (tracing) trace_buffers.resize(thread_count);
+				epoch = std::chrono::steady_clock::now();
+				for (auto& st : stages){
+					for (std::size_t n=0; n<st->threads; ++n){
+						std::vector<trace_record>* buffer = tracing ? &trace_buffers[threads.size()] : nullptr;
+						threads.emplace_back([stage=st.get(), n, buffer](){ stage->work(n, buffer); });
+					}
+				}
+				if (worker_budget) balancer = std::thread([this](){ run_balancer(); });
+			});
+		};
+
+		// Every interval: hand a spare worker from the budget to the bottleneck, or take one
+		// from a stage that can spare it. The bottleneck is the stage with the lowest capacity
+		// (workers / mean service time) among the ones that have items waiting. A stage only
+		// gives a worker away when it still has more capacity than the bottleneck has now, so
+		// the slowest of the two gets faster with every move and workers can't go back and forth.
+		void rebalance(){
+			stage_t* bottleneck = nullptr;
+			double bottleneck_capacity = 0;
+			std::size_t assigned = 0;
+			for (auto& st : stages){
+				assigned += st->workers.load();
+				double service = st->mean_service_ns();
+				if (service == 0) return; // no measurement for every stage yet
+				double capacity = double(st->workers.load()) / service;
+				if (st->backlog() && (!bottleneck || capacity < bottleneck_capacity)){
+					bottleneck = st.get();
+					bottleneck_capacity = capacity;
+				}
+			}
+			if (!bottleneck || bottleneck->workers.load() >= bottleneck->max_workers) return;
+
+			stage_t* donor = nullptr;
+			if (assigned >= worker_budget){
+				double best = bottleneck_capacity;
+				for (auto& st : stages){
+					if (st.get() == bottleneck || st->workers.load() < 2) continue;
+					double after = double(st->workers.load() - 1) / st->mean_service_ns();
+					if (after > best){
+						donor = st.get();
+						best = after;
+					}
+				}
+				if (!donor) return;
+				donor->workers.fetch_sub(1);
+			}
+			bottleneck->workers.fetch_add(1);
+			bottleneck->resized->notify_all();
+			moves.fetch_add(1);
+		};
+
+		void run_balancer(){
+			std::unique_lock<std::mutex> guard(mtx_balancer);
+			while (!cv_balancer.wait_for(guard, balance_interval, [this](){ return stop_balancer; })) rebalance();
+		};
+
+		std::int64_t now_ns() const {
+			return std::int64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count());
+		};
+
+		trace_report report() const {
+			trace_report result;
+			std::vector<std::vector<std::int64_t>> queueing(stages.size()), service(stages.size());
+			// Items are numbered densely, so the first enqueue and the last finish of every
+			// item can be looked up by number
+			std::vector<std::int64_t> origin(pushed, -1), done(pushed, -1);
+			std::uint32_t last = std::uint32_t(stages.size() - 1);
+			for (const auto& buffer : trace_buffers){
+				for (const trace_record& r : buffer){
+					queueing[r.stage].push_back(r.start_ns - r.enqueued_ns);
+					service[r.stage].push_back(r.finish_ns - r.start_ns);
+					if (r.stage == 0) origin[r.item] = r.enqueued_ns;
+					if (r.stage == last) done[r.item] = r.finish_ns;
+				}
+			}
+			for (std::size_t i=0; i<stages.size(); ++i){
+				result.stages.push_back(stage_latency{stages[i]->name, summarize(queueing[i]), summarize(service[i])});
+			}
+			std::vector<std::int64_t> end_to_end, finished;
+			for (std::uint64_t i=0; i<pushed; ++i){
+				if (origin[i] < 0 || done[i] < 0) continue;
+				end_to_end.push_back(done[i] - origin[i]);
+				finished.push_back(done[i]);
+			}
+			result.items = end_to_end.size();
+			result.end_to_end = summarize(end_to_end);
+			std::sort(finished.begin(), finished.end());
+			std::size_t lo = finished.size() / 10, hi = finished.size() - 1 - finished.size() / 10;
+			if (finished.size() > 1 && finished[hi] > finished[lo]) result.steady_throughput = double(hi - lo) / (double(finished[hi] - finished[lo]) / 1e9);
+			return result;
+		};
+
+		void join(){
+			for (auto& t : threads) if (t.joinable()) t.join();
+			if (balancer.joinable()){
+				{
+					std::lock_guard<std::mutex> guard(mtx_balancer);
+					stop_balancer = true;
+				}
+				cv_balancer.notify_all();
+				balancer.join();
+			}
+			joined = true;
+		};
+
+		~pipeline_state(){
+			// Nobody waited for the pipeline, don't hang on a stream that never ends
+			if (!joined && !threads.empty()){
+				for (auto& cancel : cancel_channels) cancel();
+				for (auto& st : stages) st->finish_input();
+				join();
+			}
+		};
+	};
+
+	template <typename T>
+	using channel_of = channel<stamped<std::conditional_t<std::is_void_v<T>, std::monostate, T>>>;
+
+	// The items a then_async() stage has started and not passed on yet. Completions come
+	// in on any thread, only the stage's output thread takes them out.
+	template <typename T>
+	struct async_stage{
+		using value_t = std::conditional_t<std::is_void_v<T>, std::monostate, T>;
+		struct finished_t{
+			value_t value;
+			std::uint64_t item;
+			std::int64_t enqueued_ns;
+			std::int64_t start_ns;
+			std::chrono::steady_clock::time_point at;
+		};
+
+		explicit async_stage(std::shared_ptr<event_count> wake) : wake(std::move(wake)){};
+
+		std::shared_ptr<event_count> wake; // the stage's resized
+		std::mutex mtx;
+		std::vector<finished_t> finished;
+		std::size_t in_flight = 0; // started and not pushed downstream yet
+		bool intake_done = false;  // the input has ended, nothing more gets started
+	};
+}
+
+// Finishes one item of a then_async() stage: call it once, from any thread, with the stage's
+// result, or with nothing when the stage is the last one and returns void.
+template <typename T>
+class stage_done{
+	public:
+		using value_t = typename detail::async_stage<T>::value_t;
+
+		void operator()(value_t value) const {
+			{
+				std::lock_guard<std::mutex> guard(stage_->mtx);
+				stage_->finished.push_back(typename detail::async_stage<T>::finished_t{std::move(value), item_, enqueued_ns_, start_ns_, std::chrono::steady_clock::now()});
+			}
+			stage_->wake->notify_all();
+		};
+		void operator()() const requires std::is_void_v<T> { (*this)(value_t{}); };
+
+	private:
+		template <typename, typename> friend class pipeline;
+		stage_done(std::shared_ptr<detail::async_stage<T>> stage, std::uint64_t item, std::int64_t enqueued_ns, std::int64_t start_ns)
+			: stage_(std::move(stage)), item_(item), enqueued_ns_(enqueued_ns), start_ns_(start_ns){};
+
+		std::shared_ptr<detail::async_stage<T>> stage_;
+		std::uint64_t item_;
+		std::int64_t enqueued_ns_;
+		std::int64_t start_ns_;
+};
+
+
+// Typed multi-stage pipeline. Every stage runs `workers` threads that pop from the stage's
+// input channel, call the stage function and push the result to the next stage. When the
+// input gets closed, the end of the stream travels down stage by stage.
+//
+//     pipeline<Person> source(64);                 // channel capacity between stages
+//     auto line = source.then("scan", 1, [](Person p){ ...; return p; })
+//                       .then("security", 4, [](Person p){ ...; }); // void: last stage
+//     line.start();
+//     for (auto& p : people) line.push(p);
+//     line.close();
+//     line.wait();
+//
+// A stage function may return void only as the last stage, otherwise the pipeline's output
+// has to be read with pop() until it returns std::nullopt. Each worker gets its own copy of
+// the stage function. The first exception thrown by a stage cancels the pipeline and wait()
+// rethrows it. With auto_balance() the worker counts become a starting point and a balancer
+// moves workers from stage to stage while the pipeline runs. enable_tracing() records when
+// every item entered, started and left every stage, trace() turns that into percentiles.
+//
+// A stage that mostly waits (a timer, I/O) doesn't have to keep a thread per item it waits on:
+//
+//     .then_async<Person>("security", 1000, [&timers](Person p, stage_done<Person> done){
+//         timers.call_after(10ms, [p, done](){ done(p); });
+//     })
+//
+// Up to `workers` items are in flight at once and the stage runs on two threads however
+// many that is, the item goes on once done() has been called.
+template <typename In, typename Out = In>
+class pipeline{
+	public:
+		explicit pipeline(std::size_t capacity=1024) requires std::is_same_v<In, Out>
+			: state_(std::make_shared<detail::pipeline_state>()), capacity_(capacity), input_(std::make_shared<detail::channel_of<In>>(capacity)), output_(input_){
+			input_->add_producers(1); // whoever calls push() and close()
+			add_channel(input_);
+		};
+
+		template <typename F>
+		auto then(std::string name, std::size_t workers, F f) -> pipeline<In, std::invoke_result_t<F&, Out>> requires (!std::is_void_v<Out>){
+			using next_t = std::invoke_result_t<F&, Out>;
+			auto [st, out] = make_stage<next_t>(std::move(name), workers);
+			auto in = output_;
+			detail::pipeline_state::stage_t* stage = st.get();
+			detail::pipeline_state* state = state_.get();
+			std::uint32_t index = std::uint32_t(state_->stages.size());
+			st->work = [state, stage, index, in, out, f](std::size_t n, std::vector<trace_record>* trace){
+				F work = f;
+				bool timed = state->worker_budget != 0 || trace;
+				while (stage->wait_turn(n)){
+					std::optional<detail::stamped<Out>> item = in->pop();
+					if (!item){
+						stage->finish_input(); // wakes up the parked workers so they can leave too
+						break;
+					}
+					if (state->failed.load(std::memory_order_relaxed)) break;
+					// Service time is the stage function alone, waiting for room downstream isn't part of it
+					std::int64_t start = timed ? state->now_ns() : 0;
+					std::int64_t finish = 0;
+					auto served = [&](){
+						if (timed){
+							finish = state->now_ns();
+							stage->busy_ns.fetch_add(std::uint64_t(finish - start), std::memory_order_relaxed);
+						}
+						if (trace) trace->push_back(trace_record{item->item, index, item->enqueued_ns, start, finish});
+						stage->items.fetch_add(1, std::memory_order_relaxed);
+					};
+					try {
+						if constexpr (std::is_void_v<next_t>){
+							work(std::move(item->value));
+							served();
+						} else {
+							next_t result = work(std::move(item->value));
+							served();
+							if (!out->push(detail::stamped<next_t>{std::move(result), item->item, finish})) break;
+						}
+					} catch (...){
+						state->fail(std::current_exception());
+					}
+				}
+				if constexpr (!std::is_void_v<next_t>) out->producer_done();
+			};
+			state_->stages.push_back(std::move(st));
+			return pipeline<In, next_t>(state_, capacity_, input_, out);
+		};
+
+		// A stage whose function only starts the work: f(item, done) returns right away and
+		// whoever finishes the item later calls done(result). `workers` items are in flight
+		// at most, one thread starts them and one pushes the results on in the order they
+		// finish. Next is the result type, void for a last stage.
+		template <typename Next = Out, typename F>
+		auto then_async(std::string name, std::size_t workers, F f) -> pipeline<In, Next> requires (!std::is_void_v<Out> && std::is_invocable_v<F&, Out, stage_done<Next>>){
+			auto [st, out] = make_stage<Next>(std::move(name), workers);
+			st->async = true;
+			auto in = output_;
+			auto async = std::make_shared<detail::async_stage<Next>>(st->resized);
+			detail::pipeline_state::stage_t* stage = st.get();
+			detail::pipeline_state* state = state_.get();
+			std::uint32_t index = std::uint32_t(state_->stages.size());
+			st->work = [state, stage, index, in, out, async, f](std::size_t n, std::vector<trace_record>* trace){
+				// Sleeps until ready() (checked under the stage's lock), false if the pipeline failed
+				auto wait_until = [state, stage, &async](auto ready){
+					auto check = [&](){
+						std::lock_guard<std::mutex> guard(async->mtx);
+						return ready();
+					};
+					while (!state->failed.load() && !check()){
+						event_count::key_t key = stage->resized->prepare_wait();
+						if (state->failed.load() || check()){
+							stage->resized->cancel_wait();
+							break;
+						}
+						stage->resized->wait(key);
+					}
+					return !state->failed.load();
+				};
+
+				if (n == 0){
+					// Intake: starts an item whenever fewer than `workers` are in flight
+					F work = f;
+					while (wait_until([&](){ return async->in_flight < stage->workers.load(); })){
+						std::optional<detail::stamped<Out>> item = in->pop();
+						if (!item || state->failed.load(std::memory_order_relaxed)) break;
+						{
+							std::lock_guard<std::mutex> guard(async->mtx);
+							++async->in_flight;
+						}
+						try {
+							work(std::move(item->value), stage_done<Next>(async, item->item, item->enqueued_ns, state->now_ns()));
+						} catch (...){
+							state->fail(std::current_exception());
+							break;
+						}
+					}
+					{
+						std::lock_guard<std::mutex> guard(async->mtx);
+						async->intake_done = true;
+					}
+					stage->resized->notify_all();
+					return;
+				}
+
+				// Output: passes finished items on, a worker is free again once its item is downstream
+				std::vector<typename detail::async_stage<Next>::finished_t> batch;
+				while (wait_until([&](){ return !async->finished.empty() || (async->intake_done && async->in_flight == 0); })){
+					{
+						std::lock_guard<std::mutex> guard(async->mtx);
+						if (async->finished.empty()) break; // nothing in flight and nothing more coming
+						batch.swap(async->finished);
+					}
+					bool cancelled = false;
+					for (auto& done : batch){
+						std::int64_t finish = std::int64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(done.at - state->epoch).count());
+						stage->busy_ns.fetch_add(std::uint64_t(std::max<std::int64_t>(finish - done.start_ns, 0)), std::memory_order_relaxed);
+						if (trace) trace->push_back(trace_record{done.item, index, done.enqueued_ns, done.start_ns, finish});
+						stage->items.fetch_add(1, std::memory_order_relaxed);
+						if constexpr (!std::is_void_v<Next>){
+							if (!out->push(detail::stamped<Next>{std::move(done.value), done.item, finish})){
+								cancelled = true;
+								break;
+							}
+						}
+					}
+					{
+						std::lock_guard<std::mutex> guard(async->mtx);
+						async->in_flight -= batch.size();
+					}
+					batch.clear();
+					stage->resized->notify_all();
+					if (cancelled) break;
+				}
+				if constexpr (!std::is_void_v<Next>) out->producer_done();
+			};
+			state_->stages.push_back(std::move(st));
+			return pipeline<In, Next>(state_, capacity_, input_, out);
+		};
+
+		// Lets a balancer thread move workers between the stages while the pipeline runs.
+		// At most `worker_budget` workers work at a time, the counts given to then() are
+		// where they start and what isn't handed out yet is the spare. Every `interval` the
+		// balancer looks at the stages' input channels and service times and gives one
+		// worker to the bottleneck. Call it before start().
+		void auto_balance(std::size_t worker_budget, std::chrono::milliseconds interval=std::chrono::milliseconds(10)){
+			if (state_->threads.size()) throw std::logic_error("A running pipeline can't start balancing.");
+			if (worker_budget < state_->stages.size()) throw std::invalid_argument("Every stage needs at least one worker from the budget.");
+			state_->worker_budget = worker_budget;
+			state_->balance_interval = interval;
+		};
+		// Workers the balancer has moved so far
+		std::size_t rebalances() const { return state_->moves.load(); };
+
+		// Records a trace_record for every item at every stage, two clock reads per item and
+		// stage into a buffer of the worker's own. Call it before start().
+		void enable_tracing(){
+			if (state_->threads.size()) throw std::logic_error("A running pipeline can't start tracing.");
+			state_->tracing = true;
+		};
+		// Queueing and service time per stage, end to end latency and throughput of a traced
+		// pipeline, after wait()
+		trace_report trace() const {
+			if (!state_->tracing || !state_->joined) throw std::logic_error("Only a traced pipeline that has finished has a trace.");
+			return state_->report();
+		};
+		// Every record, grouped by worker thread
+		std::vector<trace_record> trace_records() const {
+			if (!state_->tracing || !state_->joined) throw std::logic_error("Only a traced pipeline that has finished has a trace.");
+			std::vector<trace_record> records;
+			for (const auto& buffer : state_->trace_buffers) records.insert(records.end(), buffer.begin(), buffer.end());
+			return records;
+		};
+
+		// Opens the channels and starts every worker, push() does it on first use
+		void start(){ state_->start(); };
+
+		// Feeds the first stage, blocks while its channel is full. Call it (and close) from
+		// one thread. Returns false when the pipeline was cancelled by an error.
+		bool push(In item){
+			start();
+			return input_->push(detail::stamped<In>{std::move(item), state_->pushed++, state_->tracing ? state_->now_ns() : 0});
+		};
+		// No more input, the stages finish what is queued and then stop
+		void close(){
+			start();
+			input_->producer_done();
+		};
+
+		// Next result of the last stage, std::nullopt once the stream has ended
+		std::optional<Out> pop() requires (!std::is_void_v<Out>){
+			start();
+			std::optional<detail::stamped<Out>> item = output_->pop();
+			if (!item) return std::nullopt;
+			return std::optional<Out>(std::move(item->value));
+		};
+
+		// Waits for every stage to finish, rethrows the first exception of a stage function
+		void wait(){
+			start();
+			state_->join();
+			if (state_->error) std::rethrow_exception(state_->error);
+		};
+
+		std::vector<stage_stats> stats() const {
+			std::vector<stage_stats> result;
+			for (auto& st : state_->stages){
+				result.push_back(stage_stats{st->name, st->workers.load(), st->items.load(), state_->threads.size() && st->spsc_input(), st->mean_service_ns() / 1e6});
+			}
+			return result;
+		};
+
+	private:
+		template <typename, typename> friend class pipeline;
+
+		pipeline(std::shared_ptr<detail::pipeline_state> state, std::size_t capacity, std::shared_ptr<detail::channel_of<In>> input, std::shared_ptr<detail::channel_of<Out>> output)
+			: state_(std::move(state)), capacity_(capacity), input_(std::move(input)), output_(std::move(output)){};
+
+		// A stage reading output_ and the channel after it (none for void), work is up to the caller
+		template <typename Next>
+		std::pair<std::unique_ptr<detail::pipeline_state::stage_t>, std::shared_ptr<detail::channel_of<Next>>> make_stage(std::string name, std::size_t workers){
+			if (!workers) throw std::invalid_argument("A stage needs at least one worker.");
+			if (state_->threads.size()) throw std::logic_error("Stages can't be added to a running pipeline.");
+
+			auto in = output_;
+			std::shared_ptr<detail::channel_of<Next>> out;
+			if constexpr (!std::is_void_v<Next>){
+				out = std::make_shared<detail::channel_of<Next>>(capacity_);
+				add_channel(out);
+			}
+
+			auto st = std::make_unique<detail::pipeline_state::stage_t>();
+			st->name = std::move(name);
+			st->workers = workers;
+			st->spsc_input = [in](){ return in->is_spsc(); };
+			st->backlog = [in](){ return in->size(); };
+			st->connect = [in, out](std::size_t threads){
+				in->add_consumers(threads);
+				if constexpr (!std::is_void_v<Next>) out->add_producers(threads);
+			};
+			return {std::move(st), std::move(out)};
+		};
+
+		template <typename T>
+		void add_channel(const std::shared_ptr<channel<T>>& ch){
+			state_->open_channels.push_back([ch](){ ch->open(); });
+			state_->cancel_channels.push_back([ch](){ ch->cancel(); });
+		};
+
+		std::shared_ptr<detail::pipeline_state> state_;
+		std::size_t capacity_;
+		std::shared_ptr<detail::channel_of<In>> input_;
+		std::shared_ptr<detail::channel_of<Out>> output_;
+};
@@ -2,6 +2,9 @@
 #include <chrono>
 #include <future>
 #include <random>
+#include <iomanip>
+
+#include "threadpool.hpp"
 
 enum class TaskType { LIGHT, HEAVY};
 
@@ -89,6 +92,38 @@ int main() {
   std::cout << "Time elapsed with all async launching: " << elapsed.count() << " seconds" << std::endl;
   // =======================
 
+  // =======================
+  // Run the mix on a thread pool, first everything in one FIFO lane and then with the light
+  // (latency-critical) jobs on an urgent lane and the heavy ones on a background lane.
+  auto runOnPool = [](const char* name, std::size_t lanes) {
+    std::srand(42); // same mix for both runs
+    thread_pool::clock_type::time_point start;
+    pool_stats stats;
+    {
+      thread_pool pool(thread_pool::default_thread_count(), pool_options{.priority_lanes = lanes});
+      start = thread_pool::clock_type::now();
+      for (int i = 0; i < 100; i++) {
+        TaskType taskType = (std::rand() % 2 == 0) ? TaskType::LIGHT : TaskType::HEAVY;
+        auto job = [generator = RandomNumberGenerator(taskType)]() mutable { generator.GenerateNumbers(); };
+        if (lanes == 1) pool.do_work(job, priority_lane{0});
+        else pool.do_work(job, priority_lane{taskType == TaskType::LIGHT ? 0u : 1u});
+      }
+      while (pool.stats().delay_samples < 100) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      stats = pool.stats();
+    }
+    std::chrono::duration<double> elapsed = thread_pool::clock_type::now() - start;
+    std::cout << name << ": " << elapsed.count() << " seconds" << std::endl;
+    for (std::size_t lane = 0; lane < lanes; lane++) {
+      const lane_stats& ls = stats.lanes[lane];
+      std::cout << std::fixed << std::setprecision(0)
+                << "\tlane " << lane << ": " << ls.samples << " jobs, queueing delay p50 " << ls.p50_us / 1000
+                << "ms, p99 " << ls.p99_us / 1000 << "ms, max " << ls.max_us / 1000 << "ms" << std::defaultfloat << std::setprecision(6) << std::endl;
+    }
+  };
+  runOnPool("Time elapsed on a pool with one FIFO lane", 1);
+  runOnPool("Time elapsed on a pool with light jobs on the urgent lane", 2);
+  // =======================
+
   // Output of the program on my machine compiled using c++17:
   // Time elapsed: 37.4423 seconds
   // Time elapsed with all async launching: 12.9984 seconds
@@ -98,6 +133,8 @@ int main() {
   // This is because deferred launching does not start the task until the future's get() method is called.
   // In this case, the get() methods are called serially, so the tasks are not actually executed in parallel.
   // With async launching, the tasks are started immediately, so they can be executed in parallel as quickly as possible.
+  // On the pool the total time is the same with or without lanes, but with lanes the light jobs
+  // no longer queue behind heavy ones, their delay stays near zero while the heavy lane absorbs it.
 
   return 0;
 }
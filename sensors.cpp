@@ -4,6 +4,13 @@
 #include <thread>
 #include <chrono>
 #include <future>
+#include <atomic>
+#include <mutex>
+#include <random>
+
+#include "threadpool.hpp"
+#include "coro.hpp"
+#include "timer.hpp"
 
 
 class Sensor{
@@ -96,11 +103,53 @@ class SensorReader{
 };
 
 
+// Every sensor is a coroutine instead of a thread: between two readings it sleeps on the
+// timer and gives its thread back, so a thousand sensors share a small pool.
+class CoroutineSensorReader{
+    private:
+        thread_pool pool{2};
+        timer_queue timers{pool};
+        std::atomic<bool> isRunning{true};
+        std::mutex coutLock;
+        std::thread readerThread;
+
+        coro::task<void> readSensor(std::string name, std::chrono::milliseconds period, unsigned seed){
+            std::mt19937 generator(seed);
+            std::uniform_int_distribution<int> sensorValue(0, 4095);
+            while (isRunning.load()){
+                co_await timers.sleep_for(period);
+                int value = sensorValue(generator);
+                if (value > 4094){
+                    std::lock_guard<std::mutex> guard(coutLock);
+                    std::cout << name << ": " << value << std::endl;
+                }
+            }
+        }
+
+    public:
+        CoroutineSensorReader(int numberOfSensors){
+            std::vector<coro::task<void>> sensors;
+            for (int i = 1; i <= numberOfSensors; i++){
+                sensors.push_back(readSensor(std::string("Sensor " + std::to_string(i)), std::chrono::milliseconds(10 + i % 90), unsigned(rand())));
+            }
+            readerThread = std::thread([this, sensors = std::move(sensors)]() mutable {
+                coro::sync_wait(coro::when_all(std::move(sensors)));
+            });
+        }
+        ~CoroutineSensorReader(){ // Destructor
+            stop();
+        }
+        void stop(){ // Every sensor notices on its next wake up, then the reader thread returns
+            isRunning = false;
+            if (readerThread.joinable()) readerThread.join();
+        }
+};
+
 
 int main(){
     srand(time(NULL));
-    int numberOfSensors = 4;
-    SensorReader sensorReader(numberOfSensors);
+    int numberOfSensors = 1000;
+    CoroutineSensorReader sensorReader(numberOfSensors);
     std::cin.get(); // Wait for user to press enter
     // Destructor of sensorReader and sensors will stop their own threads
     return 0;
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "threadpool.hpp"
+
+
+// Runs a dependency graph (DAG) of work items on a thread_pool.
+// Every node lists the nodes it depends on when it is added, so the graph can't have
+// cycles. A node is handed to the pool by whichever predecessor finishes last: every
+// node has an atomic count of unfinished predecessors and nobody blocks waiting.
+//
+//     task_graph graph(pool);
+//     auto a = graph.add([]{ ... });
+//     auto b = graph.add([]{ ... });
+//     auto c = graph.add([]{ ... }, {a, b}); // runs once a and b are done
+//     graph.run(); // can be run again
+class task_graph{
+	public:
+		using node_id = std::size_t;
+
+		explicit task_graph(thread_pool& pool) : pool_(pool){};
+		task_graph(const task_graph&) = delete;
+		task_graph& operator = (const task_graph&) = delete;
+
+		node_id add(std::function<void()> work, std::initializer_list<node_id> predecessors = {}){
+			return add(std::move(work), std::vector<node_id>(predecessors));
+		};
+		node_id add(std::function<void()> work, const std::vector<node_id>& predecessors){
+			node_id id = nodes_.size();
+			for (node_id p : predecessors){
+				if (p >= id) throw std::out_of_range("Predecessor " + std::to_string(p) + " is not in the graph.");
+			}
+			auto n = std::make_unique<node_t>();
+			n->work = std::move(work);
+			n->predecessor_count = predecessors.size();
+			nodes_.push_back(std::move(n));
+			for (node_id p : predecessors) nodes_[p]->successors.push_back(id);
+			if (predecessors.empty()) roots_.push_back(id);
+			return id;
+		};
+
+		std::size_t size() const { return nodes_.size(); };
+
+		// Runs every node once and waits for all of them. Don't call it from a work item of
+		// the same pool, the waiting would take a worker away from the graph.
+		// If a node throws, the nodes that haven't started yet are skipped and run() rethrows.
+		void run(){
+			if (nodes_.empty()) return;
+			if (running_.exchange(true)) throw std::logic_error("task_graph is already running.");
+			for (auto& n : nodes_) n->pending.store(n->predecessor_count, std::memory_order_relaxed);
+			remaining_.store(nodes_.size());
+			done_ = false;
+			error_ = nullptr;
+			failed_.store(false);
+
+			// The batch keeps its capacity between runs, refilling it doesn't allocate
+			root_batch_.clear();
+			for (node_id id : roots_) root_batch_.emplace_back([this, id](){ execute(id); });
+			pool_.do_work_bulk(std::span<thread_pool::work_item_t>(root_batch_));
+
+			std::unique_lock<std::mutex> guard(mtx_done_);
+			cv_done_.wait(guard, [this](){ return done_; });
+			running_.store(false);
+			if (error_) std::rethrow_exception(error_);
+		};
+
+	private:
+		struct node_t{
+			std::function<void()> work;
+			std::vector<node_id> successors;
+			std::size_t predecessor_count = 0;
+			std::atomic<std::size_t> pending{0};
+		};
+
+		void execute(node_id id){
+			while (true){
+				node_t& n = *nodes_[id];
+				if (!failed_.load(std::memory_order_relaxed)){
+					try { n.work(); }
+					catch (...){
+						std::lock_guard<std::mutex> guard(mtx_done_);
+						if (!error_) error_ = std::current_exception();
+						failed_.store(true);
+					}
+				}
+
+				// The last predecessor to finish schedules the successor. One ready successor
+				// runs right here on this thread, the rest go to the pool.
+				bool has_next = false;
+				node_id next = 0;
+				for (node_id s : n.successors){
+					if (nodes_[s]->pending.fetch_sub(1, std::memory_order_acq_rel) != 1) continue;
+					if (!has_next){
+						has_next = true;
+						next = s;
+					}
+					else pool_.do_work([this, s](){ execute(s); });
+				}
+
+				// Whichever node finishes last (any sink, the graph can have several) ends the run.
+				// run() only returns once done_ is set and the lock is released, notify while holding it.
+				if (remaining_.fetch_sub(1, std::memory_order_acq_rel) == 1){
+					std::lock_guard<std::mutex> guard(mtx_done_);
+					done_ = true;
+					cv_done_.notify_all();
+					return;
+				}
+				if (!has_next) return;
+				id = next;
+			}
+		};
+
+		thread_pool& pool_;
+		std::vector<std::unique_ptr<node_t>> nodes_;
+		std::vector<node_id> roots_; // nodes without predecessors, in the order they were added
+		std::vector<thread_pool::work_item_t> root_batch_; // only touched by run()
+		std::atomic<std::size_t> remaining_{0};
+		std::atomic<bool> running_{false};
+		std::atomic<bool> failed_{false};
+		std::exception_ptr error_;
+		bool done_ = false; // guarded by mtx_done_
+		std::mutex mtx_done_;
+		std::condition_variable cv_done_;
+};
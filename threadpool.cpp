@@ -1,112 +1,295 @@
 #include <iostream>
 #include <thread>
 #include <mutex>
-#include <queue>
 #include <vector>
-#include <condition_variable>
 #include <chrono>
-#include <stdexcept>
-#include <functional>
-#include <memory>
-
-
-
-// source: https://www.youtube.com/watch?v=ZKIhHLM9MfQ
-class thread_pool{
-	public:
-		thread_pool(const thread_pool&) = delete;
-		thread_pool(thread_pool&&) = delete;
-		thread_pool& operator = (const thread_pool&) = delete;
-		thread_pool& operator = (thread_pool&&) = delete;
-
-		explicit thread_pool(std::size_t thread_count=(std::thread::hardware_concurrency() - 1)){
-			if (!thread_count) throw std::invalid_argument("Thread count must be non-zero.");
-			std::size_t max_threads = std::thread::hardware_concurrency();
-			if (thread_count>0 && !(thread_count<max_threads)) std::out_of_range(std::string("Thread count must be between 1 and %s.", max_threads-1));
-
-			std::cout << "Creating thread_pool with " << thread_count << " threads" << std::endl;
-			std::mutex mtx_cout;
-			for (std::size_t i=1; i<=thread_count; ++i){
-				worker_threads_.push_back(std::thread([this, thread_id=i](){
-					while (true){
-						work_item_ptr_t work{nullptr};
-						{
-							// Thread safe way to take a work item off the queue
-							std::unique_lock<std::mutex> guard(mtx_work_queue_);
-							cv_work_queue_.wait(guard, [this](){ return !work_queue_.empty(); }); // wait until there is some work to do
-							work = std::move(work_queue_.front());
-							work_queue_.pop();
-						};
-
-						if(!work) break; // when the work is a null pointer stop the thread
-
-						// Run the work item
-						(*work)();
-					}
-				}));
-			}
-		};
-		~thread_pool(){
-			if (worker_threads_.size() ==0) return;
-			{
-				// stop the threads by pushing null pointer work items
-				std::unique_lock<std::mutex> guard(mtx_work_queue_);
-				for (std::size_t i=0; i<worker_threads_.size(); ++i) work_queue_.push(work_item_ptr_t(nullptr));
-				cv_work_queue_.notify_all();
-			}
-			for (auto& t : worker_threads_) if (t.joinable()) t.join();
-			worker_threads_ = std::vector<std::thread>{};
-		};
-
-		using work_item_t = std::function<void(void)>;
-		void do_work(work_item_t work_item){
-			auto wi = std::make_unique<work_item_t>(std::move(work_item));
-			{
-				std::unique_lock<std::mutex> guard(mtx_work_queue_);
-				work_queue_.push(std::move(wi));
+#include <atomic>
+#include <iomanip>
+#include <string>
+#include <future>
+#include <array>
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+
+#include "threadpool.hpp"
+#include "async_logger.hpp"
+
+
+// Count every heap allocation in the program so we can check the pool doesn't allocate per task
+std::atomic<std::size_t> heap_allocations{0};
+void* operator new(std::size_t size){
+	heap_allocations.fetch_add(1, std::memory_order_relaxed);
+	if (void* p = std::malloc(size ? size : 1)) return p;
+	throw std::bad_alloc();
+}
+// noinline so GCC doesn't pair the inlined free() with a `new` expression and warn
+[[gnu::noinline]] void operator delete(void* p) noexcept { std::free(p); }
+[[gnu::noinline]] void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+
+
+// Runs `task_count` empty tasks on a pool and returns how many tasks per second it managed.
+// nested=false: the main thread submits every task.
+// nested=true: the main thread submits one root task per worker and the roots submit the rest,
+//              this is where work stealing keeps the submissions off the shared lock.
+double measure_throughput(scheduling_mode mode, std::size_t thread_count, std::size_t task_count, bool nested){
+	std::atomic<std::size_t> done{0};
+	auto start_time = std::chrono::high_resolution_clock::now();
+	{
+		thread_pool tp(thread_count, mode);
+		if (!nested){
+			for (std::size_t i=0; i<task_count; ++i) tp.do_work([&done](){ done.fetch_add(1, std::memory_order_relaxed); });
+		} else {
+			std::size_t per_root = task_count / thread_count;
+			for (std::size_t r=0; r<thread_count; ++r){
+				tp.do_work([&tp, &done, per_root](){
+					for (std::size_t i=0; i<per_root; ++i) tp.do_work([&done](){ done.fetch_add(1, std::memory_order_relaxed); });
+				});
 			}
-			cv_work_queue_.notify_one();
-		};
+		}
+		// Destructor drains the queues and joins the workers
+	}
+	auto end_time = std::chrono::high_resolution_clock::now();
+	std::chrono::duration<double> elapsed = end_time - start_time;
+	return done.load() / elapsed.count();
+}
 
-	private:
-		using work_item_ptr_t = std::unique_ptr<work_item_t>;
-		using work_queue_t = std::queue<work_item_ptr_t>;
-		
-		work_queue_t work_queue_;
-		std::mutex mtx_work_queue_;
-		std::condition_variable cv_work_queue_;
+void compare_scheduling_modes(){
+	std::size_t thread_count = thread_pool::default_thread_count();
+	std::size_t task_count = 1000000;
+	std::cout << "Throughput of " << task_count << " empty tasks on " << thread_count << " threads (tasks/s):" << std::endl;
+	std::cout << std::fixed << std::setprecision(0);
+	for (bool nested : {false, true}){
+		double shared = measure_throughput(scheduling_mode::shared_queue, thread_count, task_count, nested);
+		double stealing = measure_throughput(scheduling_mode::work_stealing, thread_count, task_count, nested);
+		double ring = measure_throughput(scheduling_mode::lock_free_ring, thread_count, task_count, nested);
+		std::cout << "	" << (nested ? "submitted from workers" : "submitted from main  ")
+				  << " 	 shared_queue: " << std::setw(10) << shared
+				  << " 	 work_stealing: " << std::setw(10) << stealing
+				  << " 	 lock_free_ring: " << std::setw(10) << ring << std::endl;
+	}
+	std::cout << std::defaultfloat;
+}
+
+// Pushes batches of small tasks through a pool and reports heap allocations per task. The
+// node freelists fill up over the first batches, once a whole batch went by without a single
+// allocation the pool is warm and the next batches are measured. A few nodes still get
+// made now and then, while up to 256 sit on a worker's own freelist an outside submitter
+// can't reuse them. Next to it a pool that reserve()d its nodes up front, measured from the
+// first batch. Every other batch carries a cancellation token, that mustn't allocate either.
+void count_allocations_per_task(scheduling_mode mode){
+	std::size_t batch = 10000;
+	std::atomic<std::size_t> done{0};
+	cancellation_source source;
+	auto allocations = [&](thread_pool& tp, int rounds){
+		std::size_t before = heap_allocations.load();
+		for (int round=0; round<rounds; ++round){
+			std::size_t target = done.load() + batch;
+			cancellation_token token = round % 2 ? source.token() : cancellation_token{};
+			for (std::size_t i=0; i<batch; ++i) tp.do_work([&done, payload=std::array<int, 8>{}](){ done.fetch_add(1 + payload[0], std::memory_order_relaxed); }, token);
+			while (done.load() < target) std::this_thread::yield();
+		}
+		return heap_allocations.load() - before;
+	};
 
-		using threads_t = std::vector<std::thread>;
-		threads_t worker_threads_;
-};
+	std::size_t warmup = 1;
+	double warm = 0;
+	{
+		thread_pool tp(thread_pool::default_thread_count(), mode);
+		while (warmup < 100 && allocations(tp, 1) != 0) ++warmup;
+		warm = double(allocations(tp, 4)) / double(4 * batch);
+	}
+	double reserved = 0;
+	{
+		thread_pool tp(thread_pool::default_thread_count(), mode);
+		tp.reserve(batch);
+		reserved = double(allocations(tp, 4)) / double(4 * batch);
+	}
+	std::cout << "	" << (mode == scheduling_mode::shared_queue ? "shared_queue  " : mode == scheduling_mode::work_stealing ? "work_stealing " : "lock_free_ring")
+			  << " 	 heap allocations per task, warm after " << warmup << " batches: " << warm << " 	 reserved up front: " << reserved << std::endl;
+}
+
+// Submits tasks one at a time with a pause in between (bursty, low load) and records how
+// long each one waited between do_work and starting to run. Prints percentiles in microseconds.
+void measure_wakeup_latency(const char* name, idle_policy idle){
+	using clock = std::chrono::steady_clock;
+	std::size_t samples = 2000;
+	std::vector<double> latencies(samples);
+	{
+		thread_pool tp(thread_pool::default_thread_count(), pool_options{.idle = idle});
+		for (std::size_t i=0; i<samples; ++i){
+			std::this_thread::sleep_for(std::chrono::microseconds(50));
+			std::atomic<bool> started{false};
+			auto submitted = clock::now();
+			tp.do_work([&latencies, &started, submitted, i](){
+				latencies[i] = std::chrono::duration<double, std::micro>(clock::now() - submitted).count();
+				started.store(true);
+			});
+			while (!started.load()) std::this_thread::yield();
+		}
+		std::cout << "	" << std::setw(14) << std::left << name << std::right << " parks: " << std::setw(5) << tp.park_count();
+	}
+	std::sort(latencies.begin(), latencies.end());
+	auto percentile = [&latencies](double p){ return latencies[std::size_t(p * double(latencies.size() - 1))]; };
+	std::cout << std::fixed << std::setprecision(1)
+			  << " 	 p50: " << std::setw(7) << percentile(0.50)
+			  << " 	 p90: " << std::setw(7) << percentile(0.90)
+			  << " 	 p99: " << std::setw(7) << percentile(0.99)
+			  << " 	 max: " << std::setw(7) << latencies.back() << std::defaultfloat << std::endl;
+}
+
+// Runs work that blocks (like the security check's sleep_for) on a fixed pool and on an
+// elastic pool that starts with the same size and may grow when items wait too long.
+void compare_elastic_pool(){
+	std::size_t task_count = 400;
+	auto run = [&](const char* name, std::size_t thread_count, pool_options options){
+		std::atomic<std::size_t> done{0};
+		std::chrono::duration<double, std::milli> elapsed;
+		pool_stats st;
+		{
+			thread_pool tp(thread_count, options);
+			auto start_time = std::chrono::steady_clock::now();
+			for (std::size_t i=0; i<task_count; ++i) tp.do_work([&done](){
+				std::this_thread::sleep_for(std::chrono::milliseconds(5));
+				done.fetch_add(1);
+			});
+			while (done.load() < task_count) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			elapsed = std::chrono::steady_clock::now() - start_time;
+			// Give the extra workers time to retire before reading the stats
+			if (options.elastic.max_threads) std::this_thread::sleep_for(options.elastic.idle_timeout * 3);
+			st = tp.stats();
+		}
+		std::cout << "	" << std::setw(8) << std::left << name << std::right
+				  << " 	 elapsed: " << std::setw(6) << std::fixed << std::setprecision(0) << elapsed.count() << "ms"
+				  << " 	 peak workers: " << std::setw(3) << st.peak_workers
+				  << " 	 grown: " << std::setw(3) << st.grow_count << " 	 retired: " << std::setw(3) << st.shrink_count
+				  << " 	 end workers: " << st.workers;
+		if (st.delay_samples) std::cout << std::setprecision(0) << " 	 queue delay mean: " << st.mean_queue_delay_us << "us, max: " << st.max_queue_delay_us << "us";
+		std::cout << std::defaultfloat << std::endl;
+	};
+	std::cout << task_count << " tasks blocking 5ms each:" << std::endl;
+	run("fixed", 2, pool_options{});
+	run("elastic", 2, pool_options{.elastic = elastic_policy{.min_threads = 2, .max_threads = 64,
+		.spawn_delay = std::chrono::microseconds(2000), .idle_timeout = std::chrono::milliseconds(50)}});
+}
+
+// Runs the same small batches once with a new pool per batch (waiting by destroying it) and
+// once on one pool that stays warm between batches thanks to wait_idle.
+// Then drops a batch with a cancellation token and shuts a busy pool down with discard.
+void reuse_warm_pool(){
+	std::size_t batches = 200, batch = 100;
+	std::atomic<std::size_t> done{0};
+	auto run_batch = [&done, batch](thread_pool& tp){
+		for (std::size_t i=0; i<batch; ++i) tp.do_work([&done](){ done.fetch_add(1, std::memory_order_relaxed); });
+	};
+
+	auto start_time = std::chrono::steady_clock::now();
+	for (std::size_t b=0; b<batches; ++b){
+		thread_pool tp(thread_pool::default_thread_count());
+		run_batch(tp);
+	}
+	std::chrono::duration<double, std::milli> fresh = std::chrono::steady_clock::now() - start_time;
+
+	thread_pool tp(thread_pool::default_thread_count());
+	start_time = std::chrono::steady_clock::now();
+	for (std::size_t b=0; b<batches; ++b){
+		run_batch(tp);
+		tp.wait_idle();
+	}
+	std::chrono::duration<double, std::milli> warm = std::chrono::steady_clock::now() - start_time;
+	std::cout << std::fixed << std::setprecision(1) << batches << " batches of " << batch << " tasks 	 new pool per batch: " << fresh.count()
+			  << "ms 	 one pool + wait_idle: " << warm.count() << "ms" << std::defaultfloat << std::endl;
+
+	// Keep every worker busy so the batch is still queued when it gets cancelled. The spinners
+	// have to be running first, a queued one would be dropped along with the batch
+	std::atomic<bool> release{false};
+	std::atomic<std::size_t> started{0};
+	auto occupy_workers = [&tp, &release, &started](){
+		release.store(false);
+		started.store(0);
+		for (std::size_t i=0; i<tp.size(); ++i) tp.do_work([&release, &started](){
+			started.fetch_add(1);
+			while (!release.load()) std::this_thread::yield();
+		});
+		while (started.load() < tp.size()) std::this_thread::yield();
+	};
+	occupy_workers();
+	cancellation_source source;
+	std::size_t before = done.load();
+	for (std::size_t i=0; i<batch; ++i) tp.do_work([&done](){ done.fetch_add(1, std::memory_order_relaxed); }, source.token());
+	source.cancel();
+	release.store(true);
+	tp.wait_idle();
+	std::cout << "cancelled batch 	 ran: " << done.load() - before << " 	 dropped: " << tp.stats().cancelled_count << std::endl;
+
+	occupy_workers();
+	before = done.load();
+	run_batch(tp);
+	std::thread releaser([&release](){
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		release.store(true);
+	});
+	tp.shutdown(shutdown_mode::discard);
+	releaser.join();
+	std::cout << "discarding shutdown 	 ran: " << done.load() - before << " 	 dropped in total: " << tp.stats().cancelled_count << std::endl;
+}
 
 int main(){
 	using namespace std;
-	mutex cout_lock;
+	async_logger logger;
 
 	auto start_time = chrono::high_resolution_clock::now();
 
 	{
 		thread_pool tp(2);
+		std::cout << "Creating thread_pool with " << tp.size() << " threads" << std::endl;
+		vector<thread_pool::work_item_t> work_items;
 		for (size_t i=1; i<=20; i++){
-			tp.do_work([&cout_lock, work_item_id=i](){
-				{
-					unique_lock<mutex> guard(cout_lock);
-					cout << "work item " << work_item_id << " is starting up ..." << endl;
-				}
+			work_items.emplace_back([&logger, work_item_id=i](){
+				logger.log("work item {} is starting up ...", work_item_id);
 				using namespace chrono_literals;
 				this_thread::sleep_for(2ms);
-				{
-					unique_lock<mutex> guard(cout_lock);
-					cout << "work item " << work_item_id << " is stopping ..." << endl;
-				}
+				logger.log("work item {} is stopping ...", work_item_id);
 			});
 		}
+		// One lock round-trip and one wakeup for all 20 items
+		tp.do_work_bulk(std::move(work_items));
 	}
+	logger.flush();
 
 	auto end_time = chrono::high_resolution_clock::now();
 	auto duration = chrono::duration_cast<chrono::milliseconds>(end_time - start_time);
 
 	std::cout << "Time taken: " << duration.count() << "ms" << std::endl;
+
+	compare_scheduling_modes();
+
+	std::cout << "Wakeup latency at low load (us):" << std::endl;
+	measure_wakeup_latency("park at once", idle_policy{.spin_count = 0, .yield_count = 0});
+	measure_wakeup_latency("spin then park", idle_policy{});
+	measure_wakeup_latency("spin longer", idle_policy{.spin_count = 20000, .yield_count = 200});
+
+	compare_elastic_pool();
+
+	reuse_warm_pool();
+
+	std::cout << "Allocations:" << std::endl;
+	count_allocations_per_task(scheduling_mode::shared_queue);
+	count_allocations_per_task(scheduling_mode::work_stealing);
+	count_allocations_per_task(scheduling_mode::lock_free_ring);
+
+	{
+		thread_pool tp(2);
+		auto sum = tp.submit([](int a, int b){ return a + b; }, 20, 22);
+		auto text = tp.submit([](){ return std::string("computed on the pool"); });
+		std::cout << "submit: 20 + 22 = " << sum.get() << ", " << text.get() << std::endl;
+
+		std::vector<double> values(1000000);
+		tp.parallel_for(0, values.size(), 0, [&values](std::size_t i){ values[i] = 0.5 * double(i); });
+		double total = tp.parallel_reduce(0, values.size(), 0, 0.0,
+			[&values](std::size_t i){ return values[i]; },
+			[](double a, double b){ return a + b; });
+		std::cout << "parallel_reduce: sum of " << values.size() << " values = " << std::fixed << std::setprecision(1) << total << std::defaultfloat << std::endl;
+	}
 	return 0;
 }
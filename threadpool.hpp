@@ -0,0 +1,1178 @@
+#pragma once
+
+#include <thread>
+#include <mutex>
+#include <queue>
+#include <deque>
+#include <vector>
+#include <condition_variable>
+#include <atomic>
+#include <stdexcept>
+#include <functional>
+#include <memory>
+#include <string>
+#include <algorithm>
+#include <future>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <exception>
+#include <chrono>
+#include <coroutine>
+#include <span>
+
+#include "mpmc_queue.hpp"
+#include "event_count.hpp"
+#include "topology.hpp"
+#include "latency_histogram.hpp"
+
+
+// How work is handed to the worker threads.
+//  shared_queue: every worker takes work from one queue behind one mutex.
+//  work_stealing: every worker owns a deque. Work submitted from a worker goes on
+//                 that worker's deque, work submitted from other threads goes on a
+//                 shared injection queue and idle workers steal from the others.
+//  lock_free_ring: every worker takes work from one bounded lock-free ring buffer.
+//                  Workers only take the mutex to park after spinning on an empty ring.
+enum class scheduling_mode { shared_queue, work_stealing, lock_free_ring };
+
+// What do_work does when the lock_free_ring is full.
+//  block: spin a little, then sleep until a worker frees a slot.
+//  fail: throw std::overflow_error, the work item is not queued.
+//  spin: busy-wait until there is room.
+enum class full_policy { block, fail, spin };
+
+// What an idle worker does before it goes to sleep. It polls for work spin_count
+// times with a pause instruction, then yield_count times giving its core away, and
+// only then parks. Spinning hides the wakeup latency of bursty work, parking gives
+// the CPU back when the pool stays idle.
+struct idle_policy{
+	std::size_t spin_count = 64;
+	std::size_t yield_count = 16;
+};
+
+// Lets the pool change its size with the load. Disabled while max_threads is 0.
+// A supervisor thread checks every spawn_delay / 2 how long the oldest queued item has
+// been waiting and adds a worker when that is more than spawn_delay. A worker that
+// stays parked for idle_timeout retires as long as min_threads would remain.
+// Useful for work that blocks (sleep_for, I/O) and needs more threads than cores.
+struct elastic_policy{
+	std::size_t min_threads = 1;
+	std::size_t max_threads = 0;
+	std::chrono::microseconds spawn_delay{1000};
+	std::chrono::milliseconds idle_timeout{100};
+};
+
+// What shutdown() does with the work that is still queued.
+//  drain: run all of it, including work the running items submit on the way.
+//  discard: drop it without running, only the items already running finish.
+enum class shutdown_mode { drain, discard };
+
+struct pool_options{
+	scheduling_mode mode = scheduling_mode::shared_queue;
+	std::size_t ring_capacity = 1024; // power of two, lock_free_ring only
+	full_policy when_full = full_policy::block;
+	idle_policy idle{};
+	placement place = placement::none; // pins worker i to the i-th CPU of the placement order
+	int numa_node = -1; // >= 0 keeps the workers on the CPUs of that NUMA node
+	elastic_policy elastic{};
+	// Priority lanes of the shared queue, lane 0 is the most urgent and plain do_work uses the
+	// last one. An item gains one lane of priority for every aging_step it has waited so bulk
+	// work can't be starved (0 turns aging off). Items queued with do_work_before go to an
+	// earliest-deadline-first lane that ranks one step above lane 0 and ages the same way.
+	std::size_t priority_lanes = 1;
+	std::chrono::microseconds aging_step{10000};
+};
+
+// Queueing delay of the items that went through one lane
+struct lane_stats{
+	std::size_t samples = 0;
+	double mean_us = 0;
+	double p50_us = 0;
+	double p99_us = 0;
+	double max_us = 0;
+};
+
+// Snapshot of what a pool has been doing, see thread_pool::stats()
+struct pool_stats{
+	std::size_t workers = 0;
+	std::size_t peak_workers = 0;
+	std::size_t grow_count = 0;   // workers added by the elastic supervisor
+	std::size_t shrink_count = 0; // workers retired after idle_timeout
+	std::size_t park_count = 0;
+	std::size_t cancelled_count = 0; // items dropped by a cancelled token or a discarding shutdown
+	// Time between do_work and a worker taking the item, only tracked by elastic pools,
+	// pools with priority lanes and for items with a deadline
+	std::size_t delay_samples = 0;
+	double mean_queue_delay_us = 0;
+	double max_queue_delay_us = 0;
+	std::vector<lane_stats> lanes; // priority lanes in order, then the deadline lane
+};
+
+
+// Move-only replacement for std::function<void(void)>.
+// Callables up to inline_size bytes are stored inside the task itself so submitting
+// a typical lambda never touches the heap, bigger ones fall back to one allocation.
+class task{
+	public:
+		static constexpr std::size_t inline_size = 48;
+
+		task() = default;
+		task(const task&) = delete;
+		task& operator = (const task&) = delete;
+
+		template <typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, task>>>
+		task(F&& f){
+			using fn_t = std::decay_t<F>;
+			if constexpr (fits_inline<fn_t>()){
+				::new (static_cast<void*>(storage_)) fn_t(std::forward<F>(f));
+				ops_ = &inline_ops<fn_t>;
+			} else {
+				::new (static_cast<void*>(storage_)) fn_t*(new fn_t(std::forward<F>(f)));
+				ops_ = &heap_ops<fn_t>;
+			}
+		};
+		task(task&& other) noexcept{
+			if (other.ops_) other.ops_->move(other.storage_, storage_);
+			ops_ = std::exchange(other.ops_, nullptr);
+		};
+		task& operator = (task&& other) noexcept{
+			if (this != &other){
+				reset();
+				if (other.ops_) other.ops_->move(other.storage_, storage_);
+				ops_ = std::exchange(other.ops_, nullptr);
+			}
+			return *this;
+		};
+		~task(){ reset(); };
+
+		void operator()(){ ops_->invoke(storage_); };
+		explicit operator bool() const { return ops_ != nullptr; };
+
+		void reset(){
+			if (ops_) ops_->destroy(storage_);
+			ops_ = nullptr;
+		};
+
+	private:
+		struct ops_t{
+			void (*invoke)(void*);
+			void (*move)(void* from, void* to); // move constructs into `to` and destroys `from`
+			void (*destroy)(void*);
+		};
+
+		template <typename fn_t>
+		static constexpr bool fits_inline(){
+			return sizeof(fn_t) <= inline_size && alignof(fn_t) <= alignof(std::max_align_t)
+				&& std::is_nothrow_move_constructible_v<fn_t>;
+		};
+
+		template <typename fn_t>
+		static constexpr ops_t inline_ops{
+			[](void* p){ (*static_cast<fn_t*>(p))(); },
+			[](void* from, void* to){
+				::new (to) fn_t(std::move(*static_cast<fn_t*>(from)));
+				static_cast<fn_t*>(from)->~fn_t();
+			},
+			[](void* p){ static_cast<fn_t*>(p)->~fn_t(); },
+		};
+
+		template <typename fn_t>
+		static constexpr ops_t heap_ops{
+			[](void* p){ (**static_cast<fn_t**>(p))(); },
+			[](void* from, void* to){ ::new (to) fn_t*(*static_cast<fn_t**>(from)); },
+			[](void* p){ delete *static_cast<fn_t**>(p); },
+		};
+
+		alignas(std::max_align_t) unsigned char storage_[inline_size];
+		const ops_t* ops_ = nullptr;
+};
+
+
+// Cooperative cancellation. Work queued with a token is dropped without running once the
+// token's source is cancelled, work that already started can poll cancelled() itself.
+//
+//     cancellation_source batch;
+//     pool.do_work([]{ ... }, batch.token());
+//     batch.cancel(); // whatever is still queued gets skipped
+class cancellation_token{
+	public:
+		cancellation_token() = default; // never cancelled
+		bool cancelled() const { return flag_ && flag_->load(std::memory_order_acquire); };
+		explicit operator bool() const { return flag_ != nullptr; };
+
+	private:
+		friend class cancellation_source;
+		explicit cancellation_token(std::shared_ptr<const std::atomic<bool>> flag) : flag_(std::move(flag)){};
+		std::shared_ptr<const std::atomic<bool>> flag_;
+};
+
+class cancellation_source{
+	public:
+		cancellation_source() : flag_(std::make_shared<std::atomic<bool>>(false)){};
+		void cancel(){ flag_->store(true, std::memory_order_release); };
+		bool cancelled() const { return flag_->load(std::memory_order_acquire); };
+		cancellation_token token() const { return cancellation_token(flag_); };
+
+	private:
+		std::shared_ptr<std::atomic<bool>> flag_;
+};
+
+// Which priority lane do_work queues on, a type of its own so a lane number can't be
+// mistaken for anything else in the overloads
+struct priority_lane{
+	std::size_t index = 0;
+};
+
+
+// source: https://www.youtube.com/watch?v=ZKIhHLM9MfQ
+class thread_pool{
+	public:
+		using clock_type = std::chrono::steady_clock;
+
+		thread_pool(const thread_pool&) = delete;
+		thread_pool(thread_pool&&) = delete;
+		thread_pool& operator = (const thread_pool&) = delete;
+		thread_pool& operator = (thread_pool&&) = delete;
+
+		explicit thread_pool(std::size_t thread_count=default_thread_count(), scheduling_mode mode=scheduling_mode::shared_queue)
+			: thread_pool(thread_count, pool_options{.mode = mode}){};
+
+		thread_pool(std::size_t thread_count, pool_options options)
+			: mode_(options.mode), options_(options){
+			if (!thread_count) throw std::invalid_argument("Thread count must be non-zero.");
+			if (mode_ == scheduling_mode::lock_free_ring) ring_ = std::make_unique<ring_t>(options_.ring_capacity);
+
+			// Elastic pools get every slot up front so worker ids stay stable while they come and go
+			std::size_t slot_count = thread_count;
+			elastic_ = options_.elastic.max_threads > 0;
+			if (elastic_){
+				const elastic_policy& ep = options_.elastic;
+				if (mode_ == scheduling_mode::lock_free_ring) throw std::invalid_argument("Elastic pools need a shared_queue or work_stealing pool.");
+				if (!ep.min_threads || ep.min_threads > ep.max_threads || thread_count < ep.min_threads || thread_count > ep.max_threads)
+					throw std::out_of_range("Elastic pools need 1 <= min_threads <= thread_count <= max_threads.");
+				slot_count = ep.max_threads;
+			}
+			if (!options_.priority_lanes) throw std::invalid_argument("A pool needs at least one priority lane.");
+			if (options_.priority_lanes > 1 && mode_ == scheduling_mode::lock_free_ring) throw std::invalid_argument("Priority lanes need a shared_queue or work_stealing pool.");
+			track_delay_ = elastic_ || options_.priority_lanes > 1;
+			lanes_.resize(options_.priority_lanes);
+			for (std::size_t i=0; i<=options_.priority_lanes; ++i) lane_delays_.push_back(std::make_unique<latency_histogram>());
+
+			worker_cpus_ = plan_affinity(slot_count);
+			for (std::size_t i=0; i<slot_count; ++i) worker_queues_.push_back(std::make_unique<worker_queue_t>());
+			worker_threads_.resize(slot_count);
+			worker_active_.resize(slot_count, false);
+			{
+				std::lock_guard<std::mutex> guard(mtx_workers_);
+				for (std::size_t i=0; i<thread_count; ++i) start_worker(i);
+			}
+			if (elastic_) supervisor_ = std::thread([this](){ supervise(); });
+		};
+		~thread_pool(){
+			if (current_pool_ == this){
+				// A work item is destroying its own pool. This thread can't join itself, so it
+				// is detached, the other workers drain the queue and are joined, this thread
+				// runs whatever they left and then returns out of run_worker without touching
+				// the pool again.
+				worker_threads_[current_worker_].detach();
+				join_workers(shutdown_mode::drain);
+				while (run_one(current_worker_)){}
+				current_pool_ = nullptr;
+				delete_all_nodes();
+				return;
+			}
+			shutdown(shutdown_mode::drain);
+		};
+
+		// Stops the workers and joins them, the destructor does the same with drain. Submitting
+		// after shutdown throws, wait_idle() returns right away. Calling it again does nothing.
+		void shutdown(shutdown_mode how=shutdown_mode::drain){
+			if (current_pool_ == this) throw std::logic_error("A thread_pool can't be shut down from one of its own workers.");
+			if (worker_threads_.size() ==0) return;
+			join_workers(how);
+			worker_threads_ = std::vector<std::thread>{};
+			delete_all_nodes();
+		};
+
+		static std::size_t default_thread_count(){
+			// -1 because we need one thread for the main thread
+			std::size_t max_threads = std::thread::hardware_concurrency();
+			return max_threads > 1 ? max_threads - 1 : 1;
+		};
+
+		// Workers running right now, changes over time in elastic pools
+		std::size_t size() const { return live_workers_.load(); };
+		scheduling_mode mode() const { return mode_; };
+		// How many times a worker ran out of spins and went to sleep
+		std::size_t park_count() const { return parks_.load(std::memory_order_relaxed); };
+
+		pool_stats stats() const {
+			pool_stats st;
+			st.workers = live_workers_.load();
+			st.peak_workers = peak_workers_.load();
+			st.grow_count = grows_.load();
+			st.shrink_count = shrinks_.load();
+			st.park_count = parks_.load();
+			st.cancelled_count = cancelled_.load();
+			std::uint64_t total_ns = 0;
+			for (const auto& h : lane_delays_){
+				lane_stats ls;
+				ls.samples = h->count();
+				ls.mean_us = h->mean_ns() / 1000.0;
+				ls.p50_us = double(h->percentile_ns(0.50)) / 1000.0;
+				ls.p99_us = double(h->percentile_ns(0.99)) / 1000.0;
+				ls.max_us = double(h->max_ns()) / 1000.0;
+				st.lanes.push_back(ls);
+				st.delay_samples += ls.samples;
+				total_ns += h->total_ns();
+				st.max_queue_delay_us = std::max(st.max_queue_delay_us, ls.max_us);
+			}
+			if (st.delay_samples) st.mean_queue_delay_us = double(total_ns) / double(st.delay_samples) / 1000.0;
+			return st;
+		};
+
+		// Allocates the queue nodes for `items` queued work items up front, plus what the
+		// workers keep on their own freelists, so a burst of that size never calls new.
+		// The ring has its slots already and needs nothing.
+		void reserve(std::size_t items){
+			if (ring_) return;
+			std::size_t wanted = items + worker_queues_.size() * local_free_limit;
+			std::lock_guard<std::mutex> guard(mtx_free_nodes_);
+			while (free_nodes_.count < wanted) free_nodes_.push(new work_node);
+		};
+
+		using work_item_t = task;
+		// With a token the item is skipped if it gets cancelled before a worker takes the item
+		void do_work(work_item_t work_item, cancellation_token token={}){
+			submission open(*this);
+			pending_.fetch_add(1);
+			if (ring_){
+				ring_item_t item{std::move(work_item), std::move(token)};
+				push_ring(item);
+				wake_one_idle_worker();
+				return;
+			}
+
+			work_node* node = acquire_node();
+			node->work = std::move(work_item);
+			node->cancel = std::move(token);
+			node->lane = lanes_.size() - 1;
+			node->queued_at = track_delay_ ? clock_type::now() : clock_type::time_point{};
+
+			// Work submitted from one of our own workers stays on that worker's deque
+			if (mode_ == scheduling_mode::work_stealing && current_pool_ == this){
+				worker_queue_t& local = *worker_queues_[current_worker_];
+				{
+					std::lock_guard<std::mutex> guard(local.mtx);
+					local.items.push_back(node);
+				}
+				queued_.fetch_add(1);
+				wake_one_idle_worker();
+				return;
+			}
+
+			{
+				std::unique_lock<std::mutex> guard(mtx_work_queue_);
+				lanes_.back().push_back(node);
+				queued_.fetch_add(1);
+			}
+			wake_one_idle_worker();
+		};
+
+		// Queues the item on priority lane `lane`, 0 being the most urgent. The lanes and the
+		// deadline lane below are shared by all workers, so in a work_stealing pool an item
+		// submitted from a worker goes there too instead of onto the worker's own deque.
+		void do_work(work_item_t work_item, priority_lane lane, cancellation_token token={}){
+			if (ring_) throw std::invalid_argument("Priority lanes need a shared_queue or work_stealing pool.");
+			if (lane.index >= lanes_.size()) throw std::out_of_range("Priority lane " + std::to_string(lane.index) + " doesn't exist.");
+			submission open(*this);
+			pending_.fetch_add(1);
+			work_node* node = acquire_node();
+			node->work = std::move(work_item);
+			node->cancel = std::move(token);
+			node->lane = lane.index;
+			node->queued_at = clock_type::now();
+			{
+				std::unique_lock<std::mutex> guard(mtx_work_queue_);
+				lanes_[lane.index].push_back(node);
+				queued_.fetch_add(1);
+			}
+			wake_one_idle_worker();
+		};
+
+		// Queues the item on the earliest-deadline-first lane
+		void do_work_before(work_item_t work_item, clock_type::time_point deadline, cancellation_token token={}){
+			if (ring_) throw std::invalid_argument("Deadlines need a shared_queue or work_stealing pool.");
+			submission open(*this);
+			pending_.fetch_add(1);
+			work_node* node = acquire_node();
+			node->work = std::move(work_item);
+			node->cancel = std::move(token);
+			node->lane = lanes_.size();
+			node->queued_at = clock_type::now();
+			node->deadline = deadline;
+			{
+				std::unique_lock<std::mutex> guard(mtx_work_queue_);
+				deadline_heap_.push_back(node);
+				std::push_heap(deadline_heap_.begin(), deadline_heap_.end(), later_deadline);
+				queued_.fetch_add(1);
+			}
+			wake_one_idle_worker();
+		};
+
+		// Queues many work items with one lock round-trip and one wakeup
+		void do_work_bulk(std::vector<work_item_t> work_items, const cancellation_token& token={}){
+			do_work_bulk(std::span<work_item_t>(work_items), token);
+		};
+		// Same, but moves the items out of a caller-owned batch so it can be refilled without
+		// allocating again
+		void do_work_bulk(std::span<work_item_t> work_items, const cancellation_token& token={}){
+			if (work_items.empty()) return;
+			submission open(*this);
+			if (ring_){
+				for (auto& wi : work_items) do_work(std::move(wi), token);
+				return;
+			}
+
+			pending_.fetch_add(work_items.size());
+			work_list nodes;
+			acquire_nodes(work_items.size(), nodes);
+			clock_type::time_point now = track_delay_ ? clock_type::now() : clock_type::time_point{};
+			for (work_node* node=nodes.head; auto& wi : work_items){
+				node->work = std::move(wi);
+				node->cancel = token;
+				node->lane = lanes_.size() - 1;
+				node->queued_at = now;
+				node = node->next;
+			}
+
+			if (mode_ == scheduling_mode::work_stealing && current_pool_ == this){
+				worker_queue_t& local = *worker_queues_[current_worker_];
+				{
+					std::lock_guard<std::mutex> guard(local.mtx);
+					local.items.splice_back(nodes);
+				}
+				queued_.fetch_add(work_items.size());
+				idle_.notify_all();
+				return;
+			}
+
+			{
+				std::unique_lock<std::mutex> guard(mtx_work_queue_);
+				lanes_.back().splice_back(nodes);
+				queued_.fetch_add(work_items.size());
+			}
+			if (work_items.size() == 1) idle_.notify_one();
+			else idle_.notify_all();
+		};
+
+		// Calls f(i) for every i in [begin, end). The range is cut into chunks of `grain`
+		// indices (grain 0 picks a chunk size from the thread count) and the calling
+		// thread works on chunks too, so it is safe to call from inside a work item.
+		template <typename F>
+		void parallel_for(std::size_t begin, std::size_t end, std::size_t grain, F&& f){
+			if (begin >= end) return;
+			grain = chunk_size(end - begin, grain);
+			std::size_t chunk_count = (end - begin + grain - 1) / grain;
+			run_chunks(chunk_count, [&](std::size_t chunk){
+				std::size_t first = begin + chunk * grain;
+				std::size_t last = std::min(end, first + grain);
+				for (std::size_t i=first; i<last; ++i) f(i);
+			});
+		};
+
+		// Folds map(i) for every i in [begin, end) with reduce, starting from identity.
+		// Each chunk is folded on its own and the partial results are combined in index
+		// order on the calling thread, so the result doesn't depend on the scheduling.
+		template <typename T, typename Map, typename Reduce>
+		T parallel_reduce(std::size_t begin, std::size_t end, std::size_t grain, T identity, Map&& map, Reduce&& reduce){
+			if (begin >= end) return identity;
+			grain = chunk_size(end - begin, grain);
+			std::size_t chunk_count = (end - begin + grain - 1) / grain;
+			std::vector<T> partials(chunk_count, identity);
+			run_chunks(chunk_count, [&](std::size_t chunk){
+				std::size_t first = begin + chunk * grain;
+				std::size_t last = std::min(end, first + grain);
+				T acc = identity;
+				for (std::size_t i=first; i<last; ++i) acc = reduce(std::move(acc), map(i));
+				partials[chunk] = std::move(acc);
+			});
+			T result = std::move(identity);
+			for (auto& partial : partials) result = reduce(std::move(result), std::move(partial));
+			return result;
+		};
+
+		// Like do_work but hands back the result (or the exception) through a future
+		template <typename F, typename... Args>
+		auto submit(F&& f, Args&&... args) -> std::future<std::invoke_result_t<std::decay_t<F>, std::decay_t<Args>...>>{
+			using result_t = std::invoke_result_t<std::decay_t<F>, std::decay_t<Args>...>;
+			std::packaged_task<result_t()> pt(
+				[f=std::forward<F>(f), args=std::make_tuple(std::forward<Args>(args)...)]() mutable {
+					return std::apply(std::move(f), std::move(args));
+				});
+			std::future<result_t> result = pt.get_future();
+			do_work(std::move(pt));
+			return result;
+		};
+
+		// co_await pool.schedule() moves the rest of a coroutine onto a worker of this pool
+		auto schedule(){
+			struct awaiter{
+				thread_pool& pool;
+				bool await_ready() const noexcept { return false; };
+				void await_suspend(std::coroutine_handle<> h){ pool.do_work([h](){ h.resume(); }); };
+				void await_resume() const noexcept {};
+			};
+			return awaiter{*this};
+		};
+
+		// Blocks until every submitted item has run (or was dropped), including the items
+		// those submitted on the way. The workers stay up, so the pool can take the next batch.
+		void wait_idle(){
+			if (current_pool_ == this) throw std::logic_error("wait_idle() would wait for itself when called from a worker of the same pool.");
+			std::unique_lock<std::mutex> guard(mtx_idle_);
+			idle_waiters_.fetch_add(1);
+			cv_idle_.wait(guard, [this](){ return pending_.load() == 0; });
+			idle_waiters_.fetch_sub(1);
+		};
+
+		// Submitted items that haven't finished yet, queued or running
+		std::size_t pending() const { return pending_.load(); };
+
+	private:
+		// CPUs every worker should be pinned to, empty when it may run anywhere
+		std::vector<std::vector<unsigned>> plan_affinity(std::size_t thread_count) const {
+			std::vector<std::vector<unsigned>> worker_cpus(thread_count);
+			if (options_.place == placement::none && options_.numa_node < 0) return worker_cpus;
+
+			cpu_topology topology = cpu_topology::discover();
+			if (options_.place == placement::none){
+				// Whole node, the OS balances the workers inside it
+				std::vector<unsigned> node_cpus = topology.cpus_of_node(options_.numa_node);
+				for (auto& cpus : worker_cpus) cpus = node_cpus;
+				return worker_cpus;
+			}
+			std::vector<unsigned> order = topology.placement_order(options_.place, options_.numa_node);
+			if (order.empty()) return worker_cpus;
+			for (std::size_t i=0; i<thread_count; ++i) worker_cpus[i] = {order[i % order.size()]};
+			return worker_cpus;
+		};
+
+		// Queue node, recycled through the freelists instead of being deleted
+		struct work_node{
+			task work;
+			cancellation_token cancel;
+			clock_type::time_point queued_at{}; // left at the epoch when nobody needs the delay
+			clock_type::time_point deadline{};
+			std::size_t lane = 0;
+			work_node* prev = nullptr;
+			work_node* next = nullptr;
+		};
+
+		// Ring slots carry the token next to the task, wrapping the two in one lambda
+		// would no longer fit the task's inline buffer and allocate on every submit
+		struct ring_item_t{
+			task work;
+			cancellation_token cancel;
+		};
+
+		// Intrusive doubly linked list, pushing and popping never allocates
+		struct work_list{
+			work_node* head = nullptr;
+			work_node* tail = nullptr;
+
+			bool empty() const { return head == nullptr; };
+			void push_back(work_node* node){
+				node->next = nullptr;
+				node->prev = tail;
+				if (tail) tail->next = node;
+				else head = node;
+				tail = node;
+			};
+			void splice_back(work_list& other){
+				if (other.empty()) return;
+				other.head->prev = tail;
+				if (tail) tail->next = other.head;
+				else head = other.head;
+				tail = other.tail;
+				other = work_list{};
+			};
+			work_node* pop_front(){
+				work_node* node = head;
+				head = node->next;
+				if (head) head->prev = nullptr;
+				else tail = nullptr;
+				return node;
+			};
+			work_node* pop_back(){
+				work_node* node = tail;
+				tail = node->prev;
+				if (tail) tail->next = nullptr;
+				else head = nullptr;
+				return node;
+			};
+		};
+
+		// Singly linked stack of unused nodes
+		struct node_stack{
+			work_node* head = nullptr;
+			work_node* tail = nullptr;
+			std::size_t count = 0;
+
+			void push(work_node* node){
+				node->next = head;
+				if (!head) tail = node;
+				head = node;
+				++count;
+			};
+			work_node* pop(){
+				work_node* node = head;
+				head = node->next;
+				if (!head) tail = nullptr;
+				--count;
+				return node;
+			};
+		};
+
+		// Per worker state. `items` is only used in work_stealing mode, `free_nodes` is
+		// only touched by the owning worker so it needs no lock.
+		struct worker_queue_t{
+			std::mutex mtx;
+			work_list items;
+			node_stack free_nodes;
+		};
+
+		// Nodes a worker keeps for itself before handing them back to the shared freelist
+		static constexpr std::size_t local_free_limit = 256;
+
+		work_node* acquire_node(){
+			if (current_pool_ == this){
+				node_stack& local = worker_queues_[current_worker_]->free_nodes;
+				if (local.head) return local.pop();
+			}
+			{
+				std::lock_guard<std::mutex> guard(mtx_free_nodes_);
+				if (free_nodes_.head) return free_nodes_.pop();
+			}
+			return new work_node;
+		};
+
+		// Fills `nodes` with `count` nodes taking the freelist lock at most once
+		void acquire_nodes(std::size_t count, work_list& nodes){
+			if (current_pool_ == this){
+				node_stack& local = worker_queues_[current_worker_]->free_nodes;
+				while (count && local.head){ nodes.push_back(local.pop()); --count; }
+			}
+			if (count){
+				std::lock_guard<std::mutex> guard(mtx_free_nodes_);
+				while (count && free_nodes_.head){ nodes.push_back(free_nodes_.pop()); --count; }
+			}
+			for (; count; --count) nodes.push_back(new work_node);
+		};
+
+		void release_node(std::size_t thread_id, work_node* node){
+			node->work.reset();
+			node->cancel = cancellation_token{};
+			node_stack& local = worker_queues_[thread_id]->free_nodes;
+			local.push(node);
+			if (local.count < local_free_limit) return;
+
+			// Splice the whole local stack onto the shared one so outside submitters can reuse it
+			std::lock_guard<std::mutex> guard(mtx_free_nodes_);
+			local.tail->next = free_nodes_.head;
+			if (!free_nodes_.head) free_nodes_.tail = local.tail;
+			free_nodes_.head = local.head;
+			free_nodes_.count += local.count;
+			local = node_stack{};
+		};
+
+		static void delete_nodes(node_stack& nodes){
+			while (nodes.head) delete nodes.pop();
+		};
+
+		// Queues are empty by now, only the recycled nodes are left
+		void delete_all_nodes(){
+			for (auto& wq : worker_queues_) delete_nodes(wq->free_nodes);
+			delete_nodes(free_nodes_);
+		};
+
+		// Workers finish (or drop) all queued work and then see the stop flag
+		void join_workers(shutdown_mode how){
+			if (how == shutdown_mode::discard) discarding_.store(true);
+			if (supervisor_.joinable()){
+				{
+					std::lock_guard<std::mutex> guard(mtx_workers_);
+					stop_supervisor_ = true;
+				}
+				cv_supervisor_.notify_all();
+				supervisor_.join();
+			}
+			{
+				std::lock_guard<std::mutex> guard(mtx_work_queue_);
+				closed_.store(true);
+			}
+			// Submissions already past the check finish queueing while the workers still run.
+			// A worker destroying its own pool keeps working so a full ring can't block them.
+			while (submitting_.load()){
+				if (current_pool_ != this || !run_one(current_worker_)) std::this_thread::yield();
+			}
+			stop_.store(true);
+			idle_.notify_all();
+			for (auto& t : worker_threads_) if (t.joinable()) t.join();
+		};
+
+		void run_work(std::size_t thread_id, work_node* node){
+			if (node->queued_at != clock_type::time_point{}) record_delay(node->lane, clock_type::now() - node->queued_at);
+			if (discarding_.load(std::memory_order_relaxed) || node->cancel.cancelled()) cancelled_.fetch_add(1, std::memory_order_relaxed);
+			else {
+				node->work();
+				if (!current_pool_){ delete node; return; } // see ~thread_pool
+			}
+			release_node(thread_id, node);
+			finish_item();
+		};
+
+		// Every submitted item ends here once, whether it ran or was dropped
+		void finish_item(){
+			if (pending_.fetch_sub(1) != 1 || idle_waiters_.load() == 0) return;
+			std::lock_guard<std::mutex> guard(mtx_idle_);
+			cv_idle_.notify_all();
+		};
+
+		// Held while an item is being queued. Shutdown closes the pool and then waits for the
+		// submissions that got past the check, so nothing lands in a pool whose workers are
+		// gone. The pool's own workers may still submit while it drains, they run what they
+		// queue before they exit.
+		class submission{
+			public:
+				explicit submission(thread_pool& pool) : pool_(pool){
+					pool_.submitting_.fetch_add(1);
+					if (pool_.closed_.load() && current_pool_ != &pool_){
+						pool_.submitting_.fetch_sub(1);
+						throw std::logic_error("thread_pool is shut down.");
+					}
+				};
+				submission(const submission&) = delete;
+				submission& operator = (const submission&) = delete;
+				~submission(){ pool_.submitting_.fetch_sub(1); };
+
+			private:
+				thread_pool& pool_;
+		};
+
+		std::size_t chunk_size(std::size_t n, std::size_t grain) const {
+			if (grain) return grain;
+			// A few chunks per thread (the caller counts as one) so uneven chunks even out
+			std::size_t chunk_count = std::min(n, (size() + 1) * 4);
+			return (n + chunk_count - 1) / chunk_count;
+		};
+
+		// Runs chunk_fn(0 .. chunk_count-1) on the caller and up to size() helpers.
+		// Chunks are claimed from a shared counter and the caller only waits for the chunks
+		// themselves, never for helpers to get scheduled. Helpers that start late find
+		// nothing left and only touch the shared state, which they keep alive.
+		template <typename ChunkFn>
+		void run_chunks(std::size_t chunk_count, ChunkFn&& chunk_fn){
+			struct chunk_state_t{
+				std::atomic<std::size_t> next{0};
+				std::atomic<std::size_t> finished{0};
+				std::size_t chunk_count;
+				std::remove_reference_t<ChunkFn>* chunk_fn;
+				std::exception_ptr error;
+				std::mutex mtx;
+				std::condition_variable cv;
+
+				void work(){
+					std::size_t chunk;
+					while ((chunk = next.fetch_add(1)) < chunk_count){
+						try { (*chunk_fn)(chunk); }
+						catch (...){
+							std::lock_guard<std::mutex> guard(mtx);
+							if (!error) error = std::current_exception();
+						}
+						if (finished.fetch_add(1) + 1 == chunk_count){
+							std::lock_guard<std::mutex> guard(mtx);
+							cv.notify_all();
+						}
+					}
+				};
+			};
+			auto state = std::make_shared<chunk_state_t>();
+			state->chunk_count = chunk_count;
+			state->chunk_fn = &chunk_fn;
+
+			std::size_t helpers = std::min(size(), chunk_count - 1);
+			if (helpers){
+				std::vector<work_item_t> work_items;
+				work_items.reserve(helpers);
+				for (std::size_t i=0; i<helpers; ++i) work_items.emplace_back([state](){ state->work(); });
+				do_work_bulk(std::move(work_items));
+			}
+			state->work();
+
+			std::unique_lock<std::mutex> guard(state->mtx);
+			state->cv.wait(guard, [&state](){ return state->finished.load() == state->chunk_count; });
+			if (state->error) std::rethrow_exception(state->error);
+		};
+
+		void run_worker(std::size_t thread_id){
+			while (true){
+				if (run_one(thread_id)){
+					if (!current_pool_) return; // the item destroyed the pool, `this` is gone
+					continue;
+				}
+				if (!wait_for_work()) break; // stopping and nothing left to do
+			}
+		};
+
+		// Takes one queued item and runs (or drops) it, false when there was nothing to take.
+		// If the item destroyed the pool it returns without touching the pool again.
+		bool run_one(std::size_t thread_id){
+			if (ring_){
+				ring_item_t item;
+				if (!take_ring_work(item)) return false;
+				if (discarding_.load(std::memory_order_relaxed) || item.cancel.cancelled()) cancelled_.fetch_add(1, std::memory_order_relaxed);
+				else {
+					item.work();
+					if (!current_pool_) return true;
+				}
+				item = ring_item_t{};
+				finish_item();
+				return true;
+			}
+			work_node* work = mode_ == scheduling_mode::work_stealing ? take_stealing_work(thread_id) : take_shared_work();
+			if (!work) return false;
+			run_work(thread_id, work);
+			return true;
+		};
+
+		// Lock-free peek, a true result may be stale by the time the worker looks
+		bool has_work() const {
+			return ring_ ? !ring_->empty() : queued_.load() > 0;
+		};
+
+		// Spin, then yield, then park until has_work(). Returns false once the pool is stopping and empty.
+		bool wait_for_work(){
+			for (std::size_t spin=0; spin<options_.idle.spin_count; ++spin){
+				if (has_work()) return true;
+				cpu_relax();
+			}
+			for (std::size_t spin=0; spin<options_.idle.yield_count; ++spin){
+				if (has_work()) return true;
+				std::this_thread::yield();
+			}
+			event_count::key_t key = idle_.prepare_wait();
+			if (has_work()){
+				idle_.cancel_wait();
+				return true;
+			}
+			if (stop_.load()){
+				idle_.cancel_wait();
+				return false;
+			}
+			parks_.fetch_add(1, std::memory_order_relaxed);
+			if (!elastic_){
+				idle_.wait(key);
+				return true;
+			}
+			if (idle_.wait_for(key, options_.elastic.idle_timeout)) return true;
+			return !try_retire();
+		};
+
+		// Called by a worker that stayed parked for idle_timeout. Returns true when the
+		// worker should exit.
+		bool try_retire(){
+			std::size_t live = live_workers_.load();
+			do {
+				if (live <= options_.elastic.min_threads) return false;
+			} while (!live_workers_.compare_exchange_weak(live, live - 1));
+
+			// Work may have been queued while we decided, its notify could have gone to us
+			if (has_work()){
+				live_workers_.fetch_add(1);
+				return false;
+			}
+			std::lock_guard<std::mutex> guard(mtx_workers_);
+			worker_active_[current_worker_] = false;
+			shrinks_.fetch_add(1);
+			return true;
+		};
+
+		// Needs mtx_workers_. Reuses the slot of a retired worker, whose thread has already left run_worker.
+		void start_worker(std::size_t slot){
+			if (worker_threads_[slot].joinable()) worker_threads_[slot].join();
+			worker_active_[slot] = true;
+			std::size_t live = live_workers_.fetch_add(1) + 1;
+			std::size_t peak = peak_workers_.load();
+			while (live > peak && !peak_workers_.compare_exchange_weak(peak, live)){}
+			worker_threads_[slot] = std::thread([this, thread_id=slot](){
+				if (!worker_cpus_[thread_id].empty()) pin_current_thread(worker_cpus_[thread_id]);
+				current_pool_ = this;
+				current_worker_ = thread_id;
+				run_worker(thread_id);
+			});
+		};
+
+		void supervise(){
+			const elastic_policy& ep = options_.elastic;
+			auto interval = std::max<std::chrono::microseconds>(ep.spawn_delay / 2, std::chrono::microseconds(100));
+			std::unique_lock<std::mutex> guard(mtx_workers_);
+			while (!stop_supervisor_){
+				cv_supervisor_.wait_for(guard, interval, [this](){ return stop_supervisor_; });
+				if (stop_supervisor_) break;
+				if (live_workers_.load() >= ep.max_threads) continue;
+				guard.unlock();
+				bool late = oldest_queued_age() > ep.spawn_delay;
+				guard.lock();
+				if (!late || stop_supervisor_) continue;
+				for (std::size_t slot=0; slot<worker_active_.size(); ++slot){
+					if (worker_active_[slot]) continue;
+					start_worker(slot);
+					grows_.fetch_add(1);
+					break;
+				}
+			}
+		};
+
+		// How long the oldest item that is still queued has been waiting
+		clock_type::duration oldest_queued_age(){
+			clock_type::time_point oldest = clock_type::time_point::max();
+			{
+				std::lock_guard<std::mutex> guard(mtx_work_queue_);
+				for (auto& lane : lanes_) if (!lane.empty()) oldest = std::min(oldest, lane.head->queued_at);
+				for (work_node* node : deadline_heap_) oldest = std::min(oldest, node->queued_at);
+			}
+			if (mode_ == scheduling_mode::work_stealing){
+				for (auto& wq : worker_queues_){
+					std::lock_guard<std::mutex> guard(wq->mtx);
+					if (!wq->items.empty()) oldest = std::min(oldest, wq->items.head->queued_at);
+				}
+			}
+			if (oldest == clock_type::time_point::max()) return clock_type::duration::zero();
+			return clock_type::now() - oldest;
+		};
+
+		void record_delay(std::size_t lane, clock_type::duration delay){
+			lane_delays_[lane]->record(std::uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(delay).count()));
+		};
+
+		static bool later_deadline(const work_node* a, const work_node* b){ return a->deadline > b->deadline; };
+
+		// Needs mtx_work_queue_. Takes the head of the lane with the best priority after aging.
+		work_node* pop_shared_locked(){
+			if (lanes_.size() == 1 && deadline_heap_.empty()) return lanes_[0].empty() ? nullptr : lanes_[0].pop_front();
+
+			// Lower is more urgent: the lane number (-1 for the deadline lane) minus one per aging_step waited
+			clock_type::time_point now = clock_type::now();
+			auto urgency = [&](double lane, clock_type::time_point queued_at){
+				if (options_.aging_step.count() <= 0) return lane;
+				return lane - std::chrono::duration<double>(now - queued_at) / options_.aging_step;
+			};
+			work_list* best_lane = nullptr;
+			double best = 0;
+			if (!deadline_heap_.empty()) best = urgency(-1, deadline_heap_.front()->queued_at);
+			for (std::size_t i=0; i<lanes_.size(); ++i){
+				if (lanes_[i].empty()) continue;
+				double u = urgency(double(i), lanes_[i].head->queued_at);
+				if ((deadline_heap_.empty() && !best_lane) || u < best){
+					best = u;
+					best_lane = &lanes_[i];
+				}
+			}
+			if (best_lane) return best_lane->pop_front();
+			if (deadline_heap_.empty()) return nullptr;
+			std::pop_heap(deadline_heap_.begin(), deadline_heap_.end(), later_deadline);
+			work_node* node = deadline_heap_.back();
+			deadline_heap_.pop_back();
+			return node;
+		};
+
+		work_node* take_shared_work(){
+			// Thread safe way to take a work item off the queue
+			std::unique_lock<std::mutex> guard(mtx_work_queue_);
+			work_node* node = pop_shared_locked();
+			if (node) queued_.fetch_sub(1);
+			return node;
+		};
+
+		bool take_ring_work(ring_item_t& item){
+			if (!ring_->try_pop(item)) return false;
+			// A slot is free now, wake a producer blocked on a full ring
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (blocked_producers_.load() > 0){
+				std::lock_guard<std::mutex> guard(mtx_not_full_);
+				cv_not_full_.notify_one();
+			}
+			return true;
+		};
+
+		void push_ring(ring_item_t& work_item){
+			if (ring_->try_push(work_item)) return;
+
+			// A worker waiting for room could end up waiting on itself, so it runs the item instead
+			if (current_pool_ == this){
+				if (work_item.cancel.cancelled()) cancelled_.fetch_add(1, std::memory_order_relaxed);
+				else work_item.work();
+				finish_item();
+				return;
+			}
+
+			switch (options_.when_full){
+				case full_policy::fail:
+					finish_item();
+					throw std::overflow_error("Work queue is full.");
+				case full_policy::spin:
+					while (!ring_->try_push(work_item)) cpu_relax();
+					return;
+				case full_policy::block:
+					for (std::size_t spin=0; spin<options_.idle.spin_count; ++spin){
+						if (ring_->try_push(work_item)) return;
+						cpu_relax();
+					}
+					std::unique_lock<std::mutex> guard(mtx_not_full_);
+					blocked_producers_.fetch_add(1);
+					cv_not_full_.wait(guard, [this, &work_item](){ return ring_->try_push(work_item); });
+					blocked_producers_.fetch_sub(1);
+					return;
+			}
+		};
+
+		work_node* take_stealing_work(std::size_t thread_id){
+			// Own deque first, newest item (LIFO) because its data is likely still in cache
+			{
+				worker_queue_t& local = *worker_queues_[thread_id];
+				std::lock_guard<std::mutex> guard(local.mtx);
+				if (!local.items.empty()){
+					queued_.fetch_sub(1);
+					return local.items.pop_back();
+				}
+			}
+			// Then the injection queue for work coming from outside the pool
+			{
+				std::unique_lock<std::mutex> guard(mtx_work_queue_);
+				if (work_node* node = pop_shared_locked()){
+					queued_.fetch_sub(1);
+					return node;
+				}
+			}
+			// Then steal the oldest item (FIFO) of the other workers
+			for (std::size_t i=1; i<worker_queues_.size(); ++i){
+				worker_queue_t& victim = *worker_queues_[(thread_id + i) % worker_queues_.size()];
+				std::unique_lock<std::mutex> guard(victim.mtx, std::try_to_lock);
+				if (!guard.owns_lock() || victim.items.empty()) continue;
+				queued_.fetch_sub(1);
+				return victim.items.pop_front();
+			}
+			return nullptr;
+		};
+
+		void wake_one_idle_worker(){
+			// Costs one atomic load when no worker is parked, see event_count
+			idle_.notify_one();
+		};
+
+		// The shared queue: one FIFO list per priority lane plus a min-heap on deadline
+		using work_queue_t = std::vector<work_list>;
+
+		using ring_t = bounded_mpmc_queue<ring_item_t>;
+
+		scheduling_mode mode_;
+		pool_options options_;
+
+		work_queue_t lanes_;
+		std::vector<work_node*> deadline_heap_;
+		std::mutex mtx_work_queue_;
+		std::atomic<bool> stop_{false};
+		event_count idle_;
+		std::atomic<std::size_t> parks_{0};
+
+		// Submitted but not finished items, wait_idle sleeps on cv_idle_ until it drops to 0
+		std::atomic<std::size_t> pending_{0};
+		std::atomic<std::size_t> idle_waiters_{0};
+		std::mutex mtx_idle_;
+		std::condition_variable cv_idle_;
+		std::atomic<std::size_t> cancelled_{0};
+		std::atomic<bool> discarding_{false};
+		std::atomic<bool> closed_{false};
+		std::atomic<std::size_t> submitting_{0}; // submissions between the closed_ check and queueing
+
+		std::vector<std::unique_ptr<worker_queue_t>> worker_queues_;
+		std::atomic<std::size_t> queued_{0};
+
+		node_stack free_nodes_;
+		std::mutex mtx_free_nodes_;
+
+		std::unique_ptr<ring_t> ring_;
+		std::mutex mtx_not_full_;
+		std::condition_variable cv_not_full_;
+		std::atomic<std::size_t> blocked_producers_{0};
+
+		inline static thread_local thread_pool* current_pool_ = nullptr;
+		inline static thread_local std::size_t current_worker_ = 0;
+
+		using threads_t = std::vector<std::thread>;
+		threads_t worker_threads_;
+		std::vector<std::vector<unsigned>> worker_cpus_;
+		std::atomic<std::size_t> live_workers_{0};
+		std::atomic<std::size_t> peak_workers_{0};
+
+		// Elastic mode, worker_active_ and the supervisor flag are guarded by mtx_workers_
+		bool elastic_ = false;
+		std::vector<bool> worker_active_;
+		std::mutex mtx_workers_;
+		std::condition_variable cv_supervisor_;
+		bool stop_supervisor_ = false;
+		std::thread supervisor_;
+		std::atomic<std::size_t> grows_{0};
+		std::atomic<std::size_t> shrinks_{0};
+
+		// Queueing delay per lane (the last one is the deadline lane)
+		bool track_delay_ = false;
+		std::vector<std::unique_ptr<latency_histogram>> lane_delays_;
+};
+
+
+// One thread_pool per NUMA node, each pinned to the CPUs of its node. Work that touches
+// memory first allocated (first touched) by the same node's workers then stays on that
+// node's memory controller instead of crossing the socket interconnect.
+class numa_pools{
+	public:
+		explicit numa_pools(pool_options options=pool_options{}, const cpu_topology& topology=cpu_topology::discover()){
+			for (int node : topology.numa_nodes()){
+				pool_options node_options = options;
+				node_options.numa_node = node;
+				std::size_t thread_count = std::max<std::size_t>(1, topology.cpus_of_node(node).size());
+				pools_.push_back(std::make_unique<thread_pool>(thread_count, node_options));
+				nodes_.push_back(node);
+			}
+		};
+
+		std::size_t size() const { return pools_.size(); };
+		thread_pool& operator [](std::size_t i){ return *pools_[i]; };
+		int node(std::size_t i) const { return nodes_[i]; };
+
+		// Splits [begin, end) into one contiguous share per node and runs each share with
+		// that node's pool. Calling it again with the same range gives every node the same share.
+		template <typename F>
+		void parallel_for(std::size_t begin, std::size_t end, std::size_t grain, F&& f){
+			if (begin >= end) return;
+			std::size_t share = (end - begin + size() - 1) / size();
+			std::vector<std::future<void>> done;
+			for (std::size_t i=0; i<size(); ++i){
+				std::size_t first = std::min(end, begin + i * share);
+				std::size_t last = std::min(end, first + share);
+				if (first == last) continue;
+				thread_pool& pool = *pools_[i];
+				done.push_back(pool.submit([&pool, &f, first, last, grain](){ pool.parallel_for(first, last, grain, f); }));
+			}
+			for (auto& d : done) d.get();
+		};
+
+	private:
+		std::vector<std::unique_ptr<thread_pool>> pools_;
+		std::vector<int> nodes_;
+};
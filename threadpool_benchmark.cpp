@@ -0,0 +1,248 @@
+/*
+Micro-benchmarks for thread_pool.
+
+Runs every pool variant through the same set of benchmarks and prints one line per
+(benchmark, variant, threads, metric) so runs can be diffed or plotted:
+	empty_tasks     throughput of empty tasks submitted from the main thread
+	submit_latency  time from do_work to the task starting, one task at a time
+	fan_out_in      round trip of handing a batch to the pool and waiting for all of it
+	nested          throughput of tasks that submit their own children (a binary tree)
+Every benchmark runs for 1 thread up to --threads (powers of two plus the last one), which
+is the scaling picture. Each measurement gets one warmup run that is thrown away and then
+--reps runs, the median, min and max of those are reported.
+
+F2C="threadpool_benchmark" && g++ -Wall -Wextra -std=c++23 -O2 $(pwd)/$F2C.cpp -o $F2C && ./$F2C --reps=5 --format=csv
+*/
+
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <chrono>
+#include <atomic>
+#include <iomanip>
+#include <string>
+#include <algorithm>
+#include <functional>
+#include <cstdlib>
+
+#include "threadpool.hpp"
+#include "latency_histogram.hpp"
+
+using bench_clock = std::chrono::steady_clock;
+
+struct pool_variant{
+	std::string name;
+	std::function<pool_options(std::size_t thread_count)> options;
+};
+
+// Every kind of pool the project can build
+std::vector<pool_variant> pool_variants(){
+	return {
+		{"shared_queue", [](std::size_t){ return pool_options{.mode = scheduling_mode::shared_queue}; }},
+		{"work_stealing", [](std::size_t){ return pool_options{.mode = scheduling_mode::work_stealing}; }},
+		{"lock_free_ring", [](std::size_t){ return pool_options{.mode = scheduling_mode::lock_free_ring}; }},
+		{"shared_queue_no_spin", [](std::size_t){ return pool_options{.idle = idle_policy{.spin_count = 0, .yield_count = 0}}; }},
+		{"priority_lanes", [](std::size_t){ return pool_options{.priority_lanes = 3}; }},
+		{"elastic", [](std::size_t thread_count){
+			return pool_options{.elastic = elastic_policy{.min_threads = 1, .max_threads = 2 * thread_count}};
+		}},
+	};
+}
+
+// One measurement repeated `reps` times
+struct result{
+	std::string benchmark;
+	std::string variant;
+	std::size_t threads;
+	std::string metric;
+	std::string unit;
+	std::vector<double> values;
+};
+
+struct settings{
+	std::size_t reps = 5;
+	std::size_t max_threads = thread_pool::default_thread_count();
+	std::string format = "text"; // text, csv or json
+	double scale = 1.0;          // multiplies the amount of work of every benchmark
+};
+
+
+// Spin (and yield) until `counter` reaches `target`, cheaper to wake up than a condition variable
+void wait_for_count(const std::atomic<std::size_t>& counter, std::size_t target){
+	while (counter.load(std::memory_order_acquire) < target) std::this_thread::yield();
+}
+
+// Tasks per second for `task_count` empty tasks
+std::vector<double> empty_tasks(thread_pool& tp, std::size_t task_count){
+	std::atomic<std::size_t> done{0};
+	auto start_time = bench_clock::now();
+	for (std::size_t i=0; i<task_count; ++i) tp.do_work([&done](){ done.fetch_add(1, std::memory_order_release); });
+	wait_for_count(done, task_count);
+	std::chrono::duration<double> elapsed = bench_clock::now() - start_time;
+	return {double(task_count) / elapsed.count()};
+}
+
+// p50, p99 and max of submit-to-start latency in microseconds. The next task is only
+// submitted once the previous one started, so the workers keep going back to idle.
+std::vector<double> submit_latency(thread_pool& tp, std::size_t samples){
+	latency_histogram latencies;
+	for (std::size_t i=0; i<samples; ++i){
+		std::atomic<std::size_t> started{0};
+		auto submitted = bench_clock::now();
+		tp.do_work([&latencies, &started, submitted](){
+			latencies.record(std::uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now() - submitted).count()));
+			started.store(1, std::memory_order_release);
+		});
+		wait_for_count(started, 1);
+	}
+	return {latencies.percentile_ns(0.50) / 1000.0, latencies.percentile_ns(0.99) / 1000.0, latencies.max_ns() / 1000.0};
+}
+
+// Mean and p99 of one fan-out/fan-in round trip in microseconds: `width` tasks handed over with
+// do_work_bulk and the main thread waiting for the last one
+std::vector<double> fan_out_in(thread_pool& tp, std::size_t width, std::size_t rounds){
+	latency_histogram round_trips;
+	for (std::size_t r=0; r<rounds; ++r){
+		std::atomic<std::size_t> done{0};
+		std::vector<thread_pool::work_item_t> items;
+		items.reserve(width);
+		auto start_time = bench_clock::now();
+		for (std::size_t i=0; i<width; ++i) items.emplace_back([&done](){ done.fetch_add(1, std::memory_order_release); });
+		tp.do_work_bulk(std::move(items));
+		wait_for_count(done, width);
+		round_trips.record(std::uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now() - start_time).count()));
+	}
+	return {round_trips.mean_ns() / 1000.0, round_trips.percentile_ns(0.99) / 1000.0};
+}
+
+// Tasks per second for a binary tree of tasks `depth` levels deep, every task submits its
+// two children from inside the pool
+struct tree_spawner{
+	thread_pool& tp;
+	std::atomic<std::size_t>& done;
+	void spawn(unsigned depth){
+		tp.do_work([this, depth](){
+			if (depth) {
+				spawn(depth - 1);
+				spawn(depth - 1);
+			}
+			done.fetch_add(1, std::memory_order_release);
+		});
+	};
+};
+std::vector<double> nested(thread_pool& tp, unsigned depth){
+	std::atomic<std::size_t> done{0};
+	std::size_t task_count = (std::size_t(1) << (depth + 1)) - 1;
+	tree_spawner spawner{tp, done};
+	auto start_time = bench_clock::now();
+	spawner.spawn(depth);
+	wait_for_count(done, task_count);
+	std::chrono::duration<double> elapsed = bench_clock::now() - start_time;
+	return {double(task_count) / elapsed.count()};
+}
+
+
+// Runs `measure` once to warm up (caches, freelists, elastic workers) and then `reps` times,
+// a fresh pool is built for every thread count and variant
+void run_benchmark(const settings& cfg, std::vector<result>& results, const std::string& benchmark,
+	const std::vector<std::pair<std::string, std::string>>& metrics, const std::function<std::vector<double>(thread_pool&)>& measure){
+	std::vector<std::size_t> thread_counts;
+	for (std::size_t n=1; n<cfg.max_threads; n*=2) thread_counts.push_back(n);
+	thread_counts.push_back(cfg.max_threads);
+
+	for (const pool_variant& variant : pool_variants()){
+		for (std::size_t threads : thread_counts){
+			thread_pool tp(threads, variant.options(threads));
+			measure(tp);
+			std::size_t first = results.size();
+			for (const auto& [metric, unit] : metrics) results.push_back(result{benchmark, variant.name, threads, metric, unit, {}});
+			for (std::size_t rep=0; rep<cfg.reps; ++rep){
+				std::vector<double> values = measure(tp);
+				for (std::size_t m=0; m<metrics.size(); ++m) results[first + m].values.push_back(values[m]);
+			}
+			if (cfg.format == "text") std::cerr << "." << std::flush;
+		}
+	}
+}
+
+
+double median(std::vector<double> values){
+	std::sort(values.begin(), values.end());
+	std::size_t mid = values.size() / 2;
+	return values.size() % 2 ? values[mid] : (values[mid - 1] + values[mid]) / 2;
+}
+
+void print_results(const settings& cfg, const std::vector<result>& results){
+	if (cfg.format == "csv"){
+		std::cout << "benchmark,variant,threads,metric,unit,median,min,max,reps" << std::endl;
+	} else if (cfg.format == "json"){
+		std::cout << "[" << std::endl;
+	} else {
+		std::cerr << std::endl;
+		std::cout << std::left << std::setw(16) << "benchmark" << std::setw(22) << "variant" << std::right << std::setw(8) << "threads"
+				  << "  " << std::left << std::setw(22) << "metric" << std::right << std::setw(14) << "median"
+				  << std::setw(14) << "min" << std::setw(14) << "max" << std::endl;
+	}
+
+	std::cout << std::fixed << std::setprecision(2);
+	for (std::size_t i=0; i<results.size(); ++i){
+		const result& r = results[i];
+		double mid = median(r.values);
+		double lo = *std::min_element(r.values.begin(), r.values.end());
+		double hi = *std::max_element(r.values.begin(), r.values.end());
+		if (cfg.format == "csv"){
+			std::cout << r.benchmark << "," << r.variant << "," << r.threads << "," << r.metric << "," << r.unit << ","
+					  << mid << "," << lo << "," << hi << "," << r.values.size() << std::endl;
+		} else if (cfg.format == "json"){
+			std::cout << "  {\"benchmark\": \"" << r.benchmark << "\", \"variant\": \"" << r.variant << "\", \"threads\": " << r.threads
+					  << ", \"metric\": \"" << r.metric << "\", \"unit\": \"" << r.unit << "\", \"median\": " << mid
+					  << ", \"min\": " << lo << ", \"max\": " << hi << ", \"reps\": " << r.values.size() << "}"
+					  << (i + 1 < results.size() ? "," : "") << std::endl;
+		} else {
+			std::cout << std::left << std::setw(16) << r.benchmark << std::setw(22) << r.variant << std::right << std::setw(8) << r.threads
+					  << "  " << std::left << std::setw(22) << (r.metric + " (" + r.unit + ")") << std::right
+					  << std::setw(14) << mid << std::setw(14) << lo << std::setw(14) << hi << std::endl;
+		}
+	}
+	if (cfg.format == "json") std::cout << "]" << std::endl;
+	std::cout << std::defaultfloat;
+}
+
+settings parse_arguments(int argc, char* argv[]){
+	settings cfg;
+	for (int i=1; i<argc; ++i){
+		std::string arg = argv[i];
+		auto value = [&arg](){ return arg.substr(arg.find('=') + 1); };
+		if (arg.rfind("--reps=", 0) == 0) cfg.reps = std::stoul(value());
+		else if (arg.rfind("--threads=", 0) == 0) cfg.max_threads = std::stoul(value());
+		else if (arg.rfind("--format=", 0) == 0) cfg.format = value();
+		else if (arg.rfind("--scale=", 0) == 0) cfg.scale = std::stod(value());
+		else {
+			std::cerr << "usage: " << argv[0] << " [--reps=5] [--threads=N] [--format=text|csv|json] [--scale=1.0]" << std::endl;
+			std::exit(1);
+		}
+	}
+	if (!cfg.reps || !cfg.max_threads || cfg.scale <= 0 || (cfg.format != "text" && cfg.format != "csv" && cfg.format != "json")){
+		std::cerr << "reps, threads and scale must be positive and format one of text, csv or json" << std::endl;
+		std::exit(1);
+	}
+	return cfg;
+}
+
+int main(int argc, char* argv[]){
+	settings cfg = parse_arguments(argc, argv);
+	auto scaled = [&cfg](std::size_t amount){ return std::max<std::size_t>(1, std::size_t(double(amount) * cfg.scale)); };
+	std::vector<result> results;
+
+	run_benchmark(cfg, results, "empty_tasks", {{"throughput", "tasks/s"}},
+		[&](thread_pool& tp){ return empty_tasks(tp, scaled(200000)); });
+	run_benchmark(cfg, results, "submit_latency", {{"p50", "us"}, {"p99", "us"}, {"max", "us"}},
+		[&](thread_pool& tp){ return submit_latency(tp, scaled(2000)); });
+	run_benchmark(cfg, results, "fan_out_in", {{"round_trip_mean", "us"}, {"round_trip_p99", "us"}},
+		[&](thread_pool& tp){ return fan_out_in(tp, 4 * tp.size(), scaled(2000)); });
+	run_benchmark(cfg, results, "nested", {{"throughput", "tasks/s"}},
+		[&](thread_pool& tp){ return nested(tp, 16); });
+
+	print_results(cfg, results);
+	return 0;
+}
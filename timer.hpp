@@ -0,0 +1,200 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "threadpool.hpp"
+
+
+// Runs work items on a thread_pool once a delay has passed, without any pool worker
+// waiting for it. Deadlines are rounded up to ticks and kept in a hierarchical timer wheel:
+// level 0 has one slot per tick for the next 64 ticks, level 1 one slot per 64 ticks and so
+// on. Adding a timer is O(1), a timer is moved down a level at most `levels` times and one
+// timer thread hands everything that is due to the pool with one do_work_bulk per tick.
+// The thread only wakes up for ticks that have timers or need a cascade, not every tick.
+//
+// Timers that haven't fired when the timer_queue is destroyed are dropped, so a coroutine
+// sleeping on it never resumes. Keep it alive until the sleepers are done.
+class timer_queue{
+	public:
+		using clock_type = std::chrono::steady_clock;
+
+		timer_queue(const timer_queue&) = delete;
+		timer_queue& operator = (const timer_queue&) = delete;
+
+		explicit timer_queue(thread_pool& pool, std::chrono::microseconds tick=std::chrono::milliseconds(1))
+			: pool_(pool), tick_(std::chrono::duration_cast<clock_type::duration>(tick)), start_(clock_type::now()){
+			if (tick_ <= clock_type::duration::zero()) throw std::invalid_argument("The timer tick must be positive.");
+			timer_thread_ = std::thread([this](){ run(); });
+		};
+		~timer_queue(){
+			{
+				std::lock_guard<std::mutex> guard(mtx_);
+				stop_ = true;
+			}
+			cv_.notify_all();
+			if (timer_thread_.joinable()) timer_thread_.join();
+		};
+
+		void call_at(clock_type::time_point deadline, thread_pool::work_item_t work_item){
+			bool wake;
+			{
+				std::lock_guard<std::mutex> guard(mtx_);
+				// An empty wheel may have stopped ticking, catch up so the timer lands on the right level
+				if (count_ == 0) current_tick_ = std::max(current_tick_, ticks_passed(clock_type::now()));
+				std::uint64_t due = tick_of(deadline);
+				if (due <= current_tick_) due = current_tick_ + 1; // the current tick has already fired
+				insert(entry{due, std::move(work_item)});
+				++count_;
+				wake = due < wake_tick_;
+			}
+			// Only a timer before the planned wakeup changes how long the timer thread sleeps
+			if (wake) cv_.notify_one();
+		};
+		template <typename Rep, typename Period>
+		void call_after(std::chrono::duration<Rep, Period> delay, thread_pool::work_item_t work_item){
+			call_at(clock_type::now() + std::chrono::duration_cast<clock_type::duration>(delay), std::move(work_item));
+		};
+
+		// co_await timers.sleep_for(10ms) suspends the coroutine and resumes it on the pool later
+		template <typename Rep, typename Period>
+		auto sleep_for(std::chrono::duration<Rep, Period> delay){
+			return sleep_until(clock_type::now() + std::chrono::duration_cast<clock_type::duration>(delay));
+		};
+		auto sleep_until(clock_type::time_point deadline){
+			struct awaiter{
+				timer_queue& timers;
+				clock_type::time_point deadline;
+				bool await_ready() const { return deadline <= clock_type::now(); };
+				void await_suspend(std::coroutine_handle<> h){ timers.call_at(deadline, [h](){ h.resume(); }); };
+				void await_resume() const {};
+			};
+			return awaiter{*this, deadline};
+		};
+
+		thread_pool& pool(){ return pool_; };
+		clock_type::duration tick() const { return tick_; };
+		// Timers that haven't fired yet
+		std::size_t size() const {
+			std::lock_guard<std::mutex> guard(mtx_);
+			return count_;
+		};
+
+	private:
+		struct entry{
+			std::uint64_t due; // tick the item runs at
+			thread_pool::work_item_t work;
+		};
+		using slot_t = std::vector<entry>;
+
+		static constexpr std::size_t slot_bits = 6;
+		static constexpr std::size_t slot_count = std::size_t(1) << slot_bits;
+		static constexpr std::uint64_t slot_mask = slot_count - 1;
+		static constexpr std::size_t levels = 4; // 64^4 ticks, about 4.6 hours with 1ms ticks
+
+		// Ticks since start_, rounded up so nothing fires early
+		std::uint64_t tick_of(clock_type::time_point t) const {
+			if (t <= start_) return 0;
+			return std::uint64_t((t - start_ + tick_ - clock_type::duration(1)) / tick_);
+		};
+		// Ticks that are completely over at `t`, those may fire
+		std::uint64_t ticks_passed(clock_type::time_point t) const {
+			if (t <= start_) return 0;
+			return std::uint64_t((t - start_) / tick_);
+		};
+		clock_type::time_point time_of(std::uint64_t tick) const { return start_ + tick_ * tick; };
+
+		// Needs mtx_. Level n holds the timers due within 64^(n+1) ticks, each slot of it
+		// covers 64^n ticks. Anything further away waits in overflow_.
+		void insert(entry e){
+			std::uint64_t delta = e.due - current_tick_;
+			for (std::size_t level=0; level<levels; ++level){
+				if (delta < (std::uint64_t(1) << (slot_bits * (level + 1)))){
+					wheel_[level][(e.due >> (slot_bits * level)) & slot_mask].push_back(std::move(e));
+					return;
+				}
+			}
+			overflow_.push_back(std::move(e));
+		};
+
+		// Needs mtx_. Moves to the next tick, spreads the timers of every level that wrapped
+		// over the levels below it and returns the timers due now.
+		slot_t advance(){
+			++current_tick_;
+			std::size_t wrapped = 0;
+			while (wrapped < levels && (current_tick_ & ((std::uint64_t(1) << (slot_bits * (wrapped + 1))) - 1)) == 0) ++wrapped;
+			if (wrapped == levels){
+				slot_t far = std::move(overflow_);
+				overflow_.clear();
+				for (entry& e : far) insert(std::move(e));
+			}
+			for (std::size_t level=std::min(wrapped, levels - 1); level>0; --level){
+				slot_t& s = wheel_[level][(current_tick_ >> (slot_bits * level)) & slot_mask];
+				slot_t moving = std::move(s);
+				s.clear();
+				for (entry& e : moving) insert(std::move(e));
+			}
+			slot_t due;
+			due.swap(wheel_[0][current_tick_ & slot_mask]);
+			count_ -= due.size();
+			return due;
+		};
+
+		// Needs mtx_. The next tick that has timers on level 0 or needs a cascade
+		std::uint64_t next_interesting_tick() const {
+			std::uint64_t next_wrap = (current_tick_ | slot_mask) + 1;
+			for (std::uint64_t t=current_tick_ + 1; t<next_wrap; ++t){
+				if (!wheel_[0][t & slot_mask].empty()) return t;
+			}
+			return next_wrap;
+		};
+
+		void run(){
+			std::unique_lock<std::mutex> guard(mtx_);
+			while (!stop_){
+				if (count_ == 0){
+					// Nothing to wait for, call_at skips the empty ticks in one step
+					wake_tick_ = UINT64_MAX;
+					cv_.wait(guard, [this](){ return stop_ || count_ > 0; });
+					continue;
+				}
+				wake_tick_ = next_interesting_tick();
+				if (time_of(wake_tick_) > clock_type::now()){
+					cv_.wait_until(guard, time_of(wake_tick_));
+					continue;
+				}
+				// Catch up tick by tick, a late wakeup fires everything that came due meanwhile
+				std::uint64_t now_tick = ticks_passed(clock_type::now());
+				std::vector<thread_pool::work_item_t> work_items;
+				while (current_tick_ < now_tick && count_ > 0){
+					for (entry& e : advance()) work_items.push_back(std::move(e.work));
+				}
+				if (work_items.empty()) continue;
+				guard.unlock();
+				pool_.do_work_bulk(std::move(work_items));
+				guard.lock();
+			}
+		};
+
+		thread_pool& pool_;
+		const clock_type::duration tick_;
+		const clock_type::time_point start_;
+		std::array<std::array<slot_t, slot_count>, levels> wheel_;
+		slot_t overflow_;
+		std::uint64_t current_tick_ = 0; // every timer due at or before this tick has fired
+		std::uint64_t wake_tick_ = UINT64_MAX;
+		std::size_t count_ = 0;
+		mutable std::mutex mtx_;
+		std::condition_variable cv_;
+		bool stop_ = false;
+		std::thread timer_thread_;
+};
@@ -0,0 +1,195 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <fstream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+
+// One logical CPU (hardware thread) as seen by Linux sysfs
+struct cpu_info{
+	unsigned id = 0;
+	int package_id = 0;       // socket
+	int core_id = 0;          // physical core inside the package
+	int numa_node = 0;
+	std::size_t smt_index = 0; // 0 for the first hardware thread of a core, 1 for its sibling...
+	std::vector<unsigned> smt_siblings;     // hardware threads sharing this core, this one included
+	std::vector<unsigned> last_cache_siblings; // CPUs sharing the largest cache this one has
+};
+
+// Where worker threads go.
+//  none: leave it to the OS scheduler.
+//  compact: fill every hardware thread of a core before moving to the next core, good when
+//           workers share data because they also share the caches.
+//  scatter: one thread per core first, spread over sockets and NUMA nodes, SMT siblings last.
+//           Gives memory-bound work the most cache and memory bandwidth.
+//  physical_cores: like scatter but never uses more than one hardware thread of a core.
+enum class placement { none, compact, scatter, physical_cores };
+
+
+class cpu_topology{
+	public:
+		// Reads /sys/devices/system/cpu and /sys/devices/system/node. Anything missing
+		// (other OS, containers hiding sysfs) falls back to one core per logical CPU on node 0.
+		static cpu_topology discover(){
+			cpu_topology topo;
+			std::vector<unsigned> online = parse_cpu_list(read_line("/sys/devices/system/cpu/online"));
+			if (online.empty()){
+				unsigned count = std::max(1u, std::thread::hardware_concurrency());
+				for (unsigned i=0; i<count; ++i) online.push_back(i);
+			}
+
+			std::map<unsigned, int> node_of_cpu;
+			for (int node=0; node<max_numa_nodes; ++node){
+				std::string list = read_line("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+				for (unsigned cpu : parse_cpu_list(list)) node_of_cpu[cpu] = node;
+			}
+
+			for (unsigned id : online){
+				std::string base = "/sys/devices/system/cpu/cpu" + std::to_string(id);
+				cpu_info cpu;
+				cpu.id = id;
+				cpu.package_id = read_int(base + "/topology/physical_package_id", 0);
+				cpu.core_id = read_int(base + "/topology/core_id", int(id));
+				cpu.numa_node = node_of_cpu.count(id) ? node_of_cpu[id] : 0;
+				cpu.smt_siblings = parse_cpu_list(read_line(base + "/topology/thread_siblings_list"));
+				if (cpu.smt_siblings.empty()) cpu.smt_siblings = {id};
+				cpu.smt_index = std::size_t(std::find(cpu.smt_siblings.begin(), cpu.smt_siblings.end(), id) - cpu.smt_siblings.begin());
+
+				// The highest cache level listed is the one shared the widest (usually L3)
+				int best_level = -1;
+				for (int index=0; index<max_cache_indexes; ++index){
+					std::string cache = base + "/cache/index" + std::to_string(index);
+					int level = read_int(cache + "/level", -1);
+					if (level <= best_level) continue;
+					best_level = level;
+					cpu.last_cache_siblings = parse_cpu_list(read_line(cache + "/shared_cpu_list"));
+				}
+				if (cpu.last_cache_siblings.empty()) cpu.last_cache_siblings = {id};
+				topo.cpus_.push_back(std::move(cpu));
+			}
+			return topo;
+		};
+
+		const std::vector<cpu_info>& cpus() const { return cpus_; };
+		std::size_t logical_cpu_count() const { return cpus_.size(); };
+
+		std::size_t physical_core_count() const {
+			std::set<std::pair<int, int>> cores;
+			for (const auto& cpu : cpus_) cores.insert({cpu.package_id, cpu.core_id});
+			return cores.size();
+		};
+		std::size_t package_count() const {
+			std::set<int> packages;
+			for (const auto& cpu : cpus_) packages.insert(cpu.package_id);
+			return packages.size();
+		};
+		std::vector<int> numa_nodes() const {
+			std::set<int> nodes;
+			for (const auto& cpu : cpus_) nodes.insert(cpu.numa_node);
+			return std::vector<int>(nodes.begin(), nodes.end());
+		};
+		std::vector<unsigned> cpus_of_node(int node) const {
+			std::vector<unsigned> ids;
+			for (const auto& cpu : cpus_) if (cpu.numa_node == node) ids.push_back(cpu.id);
+			return ids;
+		};
+
+		// Order in which workers take CPUs for the given policy, optionally limited to one NUMA node.
+		// Worker i of a pool goes to order[i % order.size()].
+		std::vector<unsigned> placement_order(placement policy, int only_node = -1) const {
+			std::vector<const cpu_info*> pool;
+			for (const auto& cpu : cpus_) if (only_node < 0 || cpu.numa_node == only_node) pool.push_back(&cpu);
+			if (policy == placement::none) return {};
+
+			auto core_key = [](const cpu_info* c){ return std::tuple(c->numa_node, c->package_id, c->core_id); };
+			if (policy == placement::compact){
+				std::sort(pool.begin(), pool.end(), [&](const cpu_info* a, const cpu_info* b){
+					return std::tuple(core_key(a), a->smt_index) < std::tuple(core_key(b), b->smt_index);
+				});
+			} else {
+				// Number the cores inside each node, then interleave the nodes: core 0 of every
+				// node, core 1 of every node... and only then the second hardware threads.
+				std::map<std::tuple<int, int, int>, std::size_t> core_rank;
+				std::map<int, std::size_t> cores_in_node;
+				std::vector<const cpu_info*> sorted = pool;
+				std::sort(sorted.begin(), sorted.end(), [&](const cpu_info* a, const cpu_info* b){ return core_key(a) < core_key(b); });
+				for (const cpu_info* c : sorted) if (!core_rank.count(core_key(c))) core_rank[core_key(c)] = cores_in_node[c->numa_node]++;
+				std::sort(pool.begin(), pool.end(), [&](const cpu_info* a, const cpu_info* b){
+					return std::tuple(a->smt_index, core_rank[core_key(a)], a->numa_node, a->package_id)
+						 < std::tuple(b->smt_index, core_rank[core_key(b)], b->numa_node, b->package_id);
+				});
+				if (policy == placement::physical_cores){
+					pool.erase(std::remove_if(pool.begin(), pool.end(), [](const cpu_info* c){ return c->smt_index != 0; }), pool.end());
+				}
+			}
+
+			std::vector<unsigned> order;
+			for (const cpu_info* c : pool) order.push_back(c->id);
+			return order;
+		};
+
+		// "0-3,8,10-11" -> {0,1,2,3,8,10,11}
+		static std::vector<unsigned> parse_cpu_list(const std::string& list){
+			std::vector<unsigned> ids;
+			std::stringstream ss(list);
+			std::string range;
+			while (std::getline(ss, range, ',')){
+				if (range.empty()) continue;
+				std::size_t dash = range.find('-');
+				try {
+					unsigned first = unsigned(std::stoul(range.substr(0, dash)));
+					unsigned last = dash == std::string::npos ? first : unsigned(std::stoul(range.substr(dash + 1)));
+					for (unsigned id=first; id<=last; ++id) ids.push_back(id);
+				} catch (const std::exception&){
+					return {};
+				}
+			}
+			return ids;
+		};
+
+	private:
+		static constexpr int max_numa_nodes = 64;
+		static constexpr int max_cache_indexes = 8;
+
+		static std::string read_line(const std::string& path){
+			std::ifstream file(path);
+			std::string line;
+			std::getline(file, line);
+			return line;
+		};
+		static int read_int(const std::string& path, int fallback){
+			std::string line = read_line(path);
+			try { return line.empty() ? fallback : std::stoi(line); }
+			catch (const std::exception&){ return fallback; }
+		};
+
+		std::vector<cpu_info> cpus_;
+};
+
+
+// Restricts the calling thread to the given CPUs. Returns false if the OS refused or
+// pinning isn't supported here, the thread then keeps running wherever it was.
+inline bool pin_current_thread(const std::vector<unsigned>& cpus){
+#ifdef __linux__
+	if (cpus.empty()) return false;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (unsigned cpu : cpus) if (cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+	(void)cpus;
+	return false;
+#endif
+}